@@ -11,3 +11,7 @@ typedef int8_t s8;
 typedef int16_t s16;
 typedef int32_t s32;
 typedef int64_t s64;
+
+// Forces a helper to be inlined so that constant arguments
+// get folded away in each specialised copy
+#define FORCE_INLINE static inline __attribute__((always_inline))
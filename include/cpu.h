@@ -1,5 +1,6 @@
 #pragma once
 #include "common.h"
+#include "opstats.h"
 
 #define INTERRUPT_VBLANK 0x01
 #define INTERRUPT_STAT   0x02
@@ -7,7 +8,18 @@
 #define INTERRUPT_SERIAL 0x08
 #define INTERRUPT_JOYPAD 0x10
 
+// Compile-time feature flags for the specialised execution cores.
+// Every combination gets its own copy of the cpu loop, so the fast
+// path carries no tracing, bootrom or debugger checks at all.
+#define CPU_CORE_TRACE   0x01 // Log every instruction
+#define CPU_CORE_BOOTROM 0x02 // Bootrom is mapped over 0x0000-0x00FF
+#define CPU_CORE_DEBUG   0x04 // Pause/stop-at-bootrom hooks
+#define CPU_CORE_PROFILE 0x08 // Guest code sampling profiler
+#define CPU_CORE_COUNT   0x10
+
 struct gb;
+struct tracer;
+struct profiler;
 
 struct cpu {
     union {
@@ -60,8 +72,19 @@ struct cpu {
     bool stopAtBootrom;
     bool loggingEnabled;
     u64 linesPrinted;
+    struct tracer* tracer; // Binary trace sink, NULL for text logging
+    struct profiler* profiler;
     int lastCycles;
+    u64 cycles; // Total cycles executed since reset
     struct gb* gb;
+
+    // Currently selected execution core, see cpu_update_core()
+    int (*core)(struct cpu*);
+
+#ifdef DIJON_OPCODE_STATS
+    u16 lastOpcode; // Index into instructions[] of the last instruction
+    struct opcode_stats opcodeStats[512];
+#endif
 };
 
 void cpu_init(struct cpu*, struct gb* gb);
@@ -71,7 +94,11 @@ void cpu_reset(struct cpu*);
 void cpu_request_interrupt(struct cpu*, u8 mask);
 
 void cpu_set_logging_enabled(struct cpu*, bool e);
+void cpu_set_tracer(struct cpu*, struct tracer* tracer);
+void cpu_set_profiler(struct cpu*, struct profiler* profiler);
 void cpu_set_stop_at_bootrom(struct cpu*, bool e);
+void cpu_set_paused(struct cpu*, bool p);
+void cpu_update_core(struct cpu*);
 
 int cpu_run(struct cpu*);
 int cpu_execute(struct cpu*);
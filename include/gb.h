@@ -18,6 +18,9 @@ struct ppu;
 #define P1_KEY_LEFT         0x02
 #define P1_KEY_RIGHT        0x01
 
+// DMG refresh rate, 4194304 Hz / 70224 cycles per frame
+#define GB_FRAMERATE 59.7275
+
 enum key_e {
     GB_KEY_START  = 0x80,
     GB_KEY_SELECT = 0x40,
@@ -29,7 +32,49 @@ enum key_e {
     GB_KEY_RIGHT  = 0x01
 };
 
+// Writes to memory are tracked per 256 byte page, see gb_mark_dirty()
+#define GB_PAGE_SHIFT 8
+#define GB_PAGE_COUNT 256
+
+// Running counters for performance displays, times are host nanoseconds
+struct gb_perf {
+    u64 frames;       // Emulated frames completed
+    u64 instructions; // Instructions executed
+    u64 ppuNs;        // Time spent rendering scanlines, while timePpu is set
+    bool timePpu;     // Costs two clock reads per scanline, off by default
+    u64 lastFrameNs;  // Wall time of the most recent emulated frame
+    u64 frameStart;
+};
+
+// I/O registers 0xFF00-0xFF7F get a slot each in the handler table, and IE
+// (0xFFFF) the one after. HRAM in between is plain memory
+#define GB_IO_IE    0x80
+#define GB_IO_COUNT 0x81
+
+struct gb;
+
+// Side effects of an I/O register. Either hook may be NULL, in which case
+// the register is plain storage in mmap. Write hooks store the byte
+// themselves, if at all
+struct gb_io_handler {
+    u8   (*read)(struct gb*, u16 addr);
+    void (*write)(struct gb*, u16 addr, u8 byte);
+};
+
+struct gb_pool_chunk;
+struct gb_pool_slot;
+
+// Arena that gb_clone allocates instances from, so cloning costs a few
+// memcpys and no allocations once the pool has grown. Not thread safe,
+// give each thread its own pool
+struct gb_pool {
+    int slotsPerChunk;
+    struct gb_pool_chunk* chunks;
+    struct gb_pool_slot* freeSlots;
+};
+
 struct gb {
+    struct gb_pool* pool; // NULL unless created by gb_clone
     struct cpu* cpu;
     struct ppu* ppu;
 
@@ -45,14 +90,58 @@ struct gb {
     bool inDMA;
     int dmaCycles;
     u16 dmaAddress;
+
+    u64 frameProbeStart; // See hostprof.h
+    struct gb_perf perf;
+
+    // One bit per page written since the last gb_dirty_clear(), which
+    // rewind_push() calls
+    u64 dirtyPages[GB_PAGE_COUNT / 64];
+
+    // See gb_state_hash(), covers pages 0x80-0xFF
+    u64 hashPending[GB_PAGE_COUNT / 64]; // Pages written since the last hash
+    u64 pageHashes[GB_PAGE_COUNT / 2];
+    u64 memHash;
+    u64 cartRamHash;
 };
 
 void gb_init(struct gb*);
 int gb_run(struct gb*, bool* stopped, bool* frameCompleted);
 void gb_destroy(struct gb*);
+u64 gb_state_hash(struct gb*);
+struct gb* gb_clone(struct gb_pool* pool, const struct gb* src);
+void gb_pool_init(struct gb_pool* pool, int slotsPerChunk);
+void gb_pool_destroy(struct gb_pool* pool);
 void gb_init_mmap(struct gb*);
 void gb_readBootrom(struct gb*, FILE *bootrom);
-void gb_readRom(struct gb*, FILE* rom);
+int gb_readRom(struct gb*, FILE* rom);
+int gb_load_sav(struct gb*, const char* path);
+void gb_skip_bootrom(struct gb*);
+void gb_disable_bootrom(struct gb*);
+
+void gb_dirty_clear(struct gb*);
+void gb_dirty_mark_all(struct gb*);
+
+// Branch free, so it can stay on in every write. The state hash keeps
+// its own bitmap, so gb_dirty_clear() doesn't affect it
+static inline void gb_mark_dirty(struct gb* gb, u16 addr) {
+    u64 bit = 1ULL << ((addr >> GB_PAGE_SHIFT) & 63);
+    gb->dirtyPages[addr >> 14] |= bit;
+    gb->hashPending[addr >> 14] |= bit;
+}
+
+static inline bool gb_page_dirty(const struct gb* gb, int page) {
+    return (gb->dirtyPages[page >> 6] >> (page & 63)) & 1;
+}
+
+void gb_io_register(u16 addr, u8 (*read)(struct gb*, u16), void (*write)(struct gb*, u16, u8));
+
+// Slot in the I/O handler table for addr >= 0xFF00, -1 for HRAM
+static inline int gb_io_index(u16 addr) {
+    if(addr < 0xFF80)
+        return addr & 0x7F;
+    return (addr == 0xFFFF)? GB_IO_IE : -1;
+}
 
 void gb_dma(struct gb* gb);
 void gb_keypress(struct gb* gb, enum key_e key);
@@ -60,6 +149,8 @@ void gb_keyrelease(struct gb* gb, enum key_e key);
 
 u8* gb_get_mmap_ptr(struct gb*, u16 addr);
 u8 gb_read8(struct gb*, u16 addr);
+u8 gb_read8_postboot(struct gb*, u16 addr);
 void gb_write8(struct gb*, u16 addr, u8 byte);
 u16 gb_read16(struct gb*, u16 addr);
+u16 gb_read16_postboot(struct gb*, u16 addr);
 void gb_write16(struct gb*, u16 addr, u16 word);
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdatomic.h>
+
+#include "common.h"
+
+// Host-side timing probes around the expensive phases of a frame,
+// exported as Chrome trace-event JSON (chrome://tracing, Perfetto).
+// While not capturing, each probe costs a single relaxed load and
+// a well-predicted branch.
+
+enum hostprof_phase {
+    HOSTPROF_FRAME,          // One emulated frame, cpu time is its self time
+    HOSTPROF_PPU_SCANLINE,
+    HOSTPROF_OAM_DMA,
+    HOSTPROF_TEXTURE_UPLOAD,
+    HOSTPROF_IMGUI,
+    HOSTPROF_PRESENT,
+
+    HOSTPROF_PHASE_COUNT
+};
+
+// Events per thread; older ones are overwritten. Must be a power of two
+#define HOSTPROF_BUFFER_SIZE (1 << 16)
+
+extern atomic_bool gHostprofCapturing;
+
+struct hostprof_scope {
+    u64 start;
+    enum hostprof_phase phase;
+};
+
+void hostprof_start();
+void hostprof_stop();
+int hostprof_write_json(const char* path);
+void hostprof_destroy();
+
+u64 hostprof_now();
+void hostprof_record(enum hostprof_phase phase, u64 start);
+
+// Returns the start time, or 0 if not capturing
+static inline u64 hostprof_begin() {
+    if(__builtin_expect(atomic_load_explicit(&gHostprofCapturing, memory_order_relaxed), 0)) {
+        return hostprof_now();
+    }
+    return 0;
+}
+
+static inline void hostprof_end(enum hostprof_phase phase, u64 start) {
+    if(start != 0) {
+        hostprof_record(phase, start);
+    }
+}
+
+static inline void hostprof_scope_end(struct hostprof_scope* s) {
+    hostprof_end(s->phase, s->start);
+}
+
+// Times the rest of the enclosing block
+#define HOSTPROF_SCOPE(p) \
+    struct hostprof_scope hostprofScope __attribute__((cleanup(hostprof_scope_end))) = { hostprof_begin(), p }
@@ -8,5 +8,8 @@ extern struct instr_t {
     const char* disasm;
 } instructions[512];
 
+// Specialisations of the instruction decoder, see CPU_CORE_* in cpu.h
 int execute_instr(struct cpu* cpu);
-int execute_CB(struct cpu* cpu, u8 opcode);
+int execute_instr_trace(struct cpu* cpu);
+int execute_instr_bootrom(struct cpu* cpu);
+int execute_instr_bootrom_trace(struct cpu* cpu);
@@ -3,26 +3,93 @@
 
 struct cart_t;
 
+// Mapper behaviour only, the register values live in each cart_t
 extern struct mbc {
-    u8 regs[4];
-
     void (*write8)(struct cart_t*, u16, u8);
     void (*write16)(struct cart_t*, u16, u16);
     u8   (*read8)(struct cart_t*, u16);
     u16  (*read16)(struct cart_t*, u16);
-} mbcs[4];
+} mbcs[6];
+
+struct rom_image;
+
+// Where cart_t.ram lives
+#define CART_RAM_NONE     0
+#define CART_RAM_HEAP     1 // calloc'd, owned by the cart
+#define CART_RAM_MAPPED   2 // Mapped from the .sav file
+#define CART_RAM_BORROWED 3 // Owned by someone else, e.g. a clone's pool slot
+
+// Battery RAM is msync'd at most this often, in frames
+#define CART_SAV_SYNC_FRAMES 60
+
+// The MBC3 clock counts emulated cpu cycles
+#define CART_RTC_HZ 4194304
+// Clock registers are kept after the RAM in .sav files, in the 48 byte
+// layout most emulators share: live and latched registers as 32-bit
+// little endian words, then a 64-bit unix timestamp of when it was saved
+#define CART_RTC_SAV_BYTES 48
+
+// MBC3 real-time clock. Nothing ticks: the time is worked out from the
+// cycle counter when the game latches it or writes a register
+struct cart_rtc {
+    s64 base;       // Clock in seconds at baseCycle
+    u64 baseCycle;
+    bool halted;
+    bool carry;     // The day counter overflowed
+    u8 latched[5];  // Seconds, minutes, hours, day low, day high
+    u8 select;      // Register mapped at 0xA000-0xBFFF (0x08-0x0C), or 0
+};
 
 struct cart_t {
-    u8* rom;
+    u8* rom; // Shared and read-only, owned by image
+    struct rom_image* image;
     struct mbc* mbc;
 
+    u8 regs[4];  // Mapper registers, see MBC*_ defines below
+    u16 romBank;    // Bank currently mapped at 0x4000-0x7FFF
+    u16 romBanks;   // 16KB banks in the image
+    u8* romBankPtr; // Start of romBank, see cart_map_rom_bank()
+
     u8 mbcCode;
     u8 romSize;
     u8 ramSize;
+
+    // External RAM at 0xA000-0xBFFF
+    u8* ram;
+    u32 ramBytes;
+    u8 ramBanks;
+    u8 ramBank;         // Bank currently mapped
+    u8* ramBankPtr;     // Start of ramBank, see cart_map_ram_bank()
+    u16 ramMask;        // Offset mask within a bank
+    u8 ramBacking;      // CART_RAM_*
+    bool ramEnabled;
+    bool battery;
+    bool ramTouched;    // Written since the last gb_state_hash()
+    u32 ramDirtyStart;  // Byte range written since the last .sav sync
+    u32 ramDirtyEnd;
+    int framesSinceSync;
+    char* savPath;      // Only kept where .sav files can't be mapped
+    u8* sav;            // Mapped .sav file, RAM followed by the clock
+    u32 savBytes;
+
+    bool hasRtc;
+    struct cart_rtc rtc;
+    const u64* cycles;  // Emulated time, the cpu's cycle counter
 };
 
 void initMBCs();
 
+void cart_map_rom_bank(struct cart_t* cart, u16 bank);
+void cart_map_ram_bank(struct cart_t* cart, u8 bank);
+
+int cart_ram_init(struct cart_t* cart);
+int cart_ram_open_sav(struct cart_t* cart, const char* path);
+void cart_ram_sync(struct cart_t* cart, bool force);
+void cart_ram_frame(struct cart_t* cart);
+void cart_ram_destroy(struct cart_t* cart);
+u8 cart_ram_read8(struct cart_t* cart, u16 addr);
+void cart_ram_write8(struct cart_t* cart, u16 addr, u8 v);
+
 void mbc0_write8(struct cart_t* cart, u16 addr, u8 v);
 void mbc0_write16(struct cart_t* cart, u16 addr, u16 v);
 u8   mbc0_read8(struct cart_t* cart, u16 addr);
@@ -37,9 +104,20 @@ void mbc1_write16(struct cart_t* cart, u16 addr, u16 v);
 u8   mbc1_read8(struct cart_t* cart, u16 addr);
 u16  mbc1_read16(struct cart_t* cart, u16 addr);
 
-// TODO: More registers
 #define MBC3_ROMBANK    0
+#define MBC3_RAMENABLE  1
+#define MBC3_RAMBANK    2
+#define MBC3_LATCH      3
 void mbc3_write8(struct cart_t* cart, u16 addr, u8 v);
 void mbc3_write16(struct cart_t* cart, u16 addr, u16 v);
 u8   mbc3_read8(struct cart_t* cart, u16 addr);
 u16  mbc3_read16(struct cart_t* cart, u16 addr);
+
+#define MBC5_RAMENABLE  0
+#define MBC5_ROMBANKLO  1
+#define MBC5_ROMBANKHI  2
+#define MBC5_RAMBANK    3
+void mbc5_write8(struct cart_t* cart, u16 addr, u8 v);
+void mbc5_write16(struct cart_t* cart, u16 addr, u16 v);
+u8   mbc5_read8(struct cart_t* cart, u16 addr);
+u16  mbc5_read16(struct cart_t* cart, u16 addr);
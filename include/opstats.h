@@ -0,0 +1,20 @@
+#pragma once
+#include "common.h"
+
+// Per-opcode execution and cycle counters. Only compiled in when
+// DIJON_OPCODE_STATS is defined, so normal builds pay nothing.
+#ifdef DIJON_OPCODE_STATS
+
+struct cpu;
+
+// Indexed like instructions[]: 0x000-0x0FF base, 0x100-0x1FF CB-prefixed
+struct opcode_stats {
+    u64 count;
+    u64 cycles;
+};
+
+void opstats_reset(struct cpu*);
+// Writes CSV, or JSON if path ends in .json. Returns -1 on error
+int opstats_write(struct cpu*, const char* path);
+
+#endif
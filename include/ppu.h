@@ -3,9 +3,73 @@
 #include "common.h"
 
 extern const u32 gColors[4];
+extern const u8 gReverseBits[256];
 
 struct gb;
 
+// 144 lines, one bit each, see ppu_take_changed_lines()
+#define PPU_LINE_WORDS 3
+
+// Pixel formats ppu_set_output() can draw in
+enum ppu_format_e {
+    PPU_FORMAT_ARGB8888, // gColors
+    PPU_FORMAT_RGB565,   // gColors, reduced
+    PPU_FORMAT_SHADE8    // The DMG shade, 0 (lightest) to 3
+};
+
+// Ways of drawing mode 3, chosen per instance with ppu_set_renderer()
+enum ppu_renderer_e {
+    PPU_RENDERER_SCANLINE, // A whole line at once, mode 3 always 43 cycles
+    PPU_RENDERER_FIFO,     // Dot by dot through the pixel FIFO, see ppu_fifo.c
+    PPU_RENDERER_COUNT
+};
+
+struct ppu;
+
+struct ppu_renderer {
+    const char* name;
+    // Called as mode 3 starts, may be NULL
+    void (*begin)(struct ppu*);
+    // Catches up with the cycles spent in mode 3 so far. Returns how long
+    // mode 3 took once the line is finished, 0 until then
+    int (*run)(struct ppu*);
+};
+
+extern const struct ppu_renderer gPPURenderers[PPU_RENDERER_COUNT];
+
+// State of the pixel FIFO renderer within a line. Plain bytes, so save
+// states can copy it as is
+struct ppu_fifo {
+    s32 dots;    // Dots since mode 3 started
+    u8 x;        // Next pixel to go out
+    u8 discard;  // Pixels still to drop, the fine scroll
+    u8 warmup;   // The first tile fetched on a line is thrown away
+    u8 inWindow;
+
+    // BG and window fetcher
+    u8 fetchStep;
+    u8 fetchDot;
+    u8 fetchX;   // Tile column
+    u8 tileId;
+    u8 tileLo;
+    u8 tileHi;
+
+    // The FIFOs as shift registers, next pixel in the high bit. The
+    // object FIFO always holds 8 pixels, transparent where empty
+    u8 bgLo;
+    u8 bgHi;
+    u8 bgCount;
+    u8 objLo;
+    u8 objHi;
+    u8 objPal;
+    u8 objPri;
+
+    u8 objFetch; // scanlineObjs entry being fetched, 0xFF if none
+    u8 objDots;
+    u8 pad[3];
+    u16 objsDone; // One bit per scanlineObjs entry
+};
+
 struct obj_t {
     u8 y;
     u8 x;
@@ -22,13 +86,37 @@ struct obj_t {
 
 struct ppu {
     struct gb* gb;
-    u32 framebuffer[160*144];
+    u32 framebuffer[160*144]; // The output unless another is set
+    u8 shades[144][160];      // The frame as rendered, output is made from it
+    u8 line[160];             // The scanline being rendered
+    u64 changedLines[PPU_LINE_WORDS]; // Lines that differ from the last frame
     int cyclesThisMode;
     int vblankCycles;
+    int hblankCycles; // What's left of the line after mode 3
+
+    const struct ppu_renderer* renderer;
+    struct ppu_fifo fifo;
+
+    // The window has its own line counter, which only advances on lines
+    // that showed it. It starts once LY has matched WY in a frame
+    u8 winLine;
+    bool winTriggered;
 
     u8 objsThisScanline;
     u8 scanlineObjs[10];
 
+    // Objects on each visible line, up to 10 in OAM order. Rebuilt by
+    // ppu_index_objs() before the next OAM search whenever OAM or the
+    // object height changes, so the search itself is a lookup
+    u8 lineObjCount[144];
+    u8 lineObjs[144][10];
+    bool objIndexDirty;
+
+    // One bit per pixel of the current line, leftmost in the high bit and
+    // 8 pixels of padding on both sides, see ppu_scanline_objs()
+    u8 bgLineMask[22];  // BG colour index is not 0
+    u8 objLineMask[22]; // Taken by a higher priority object
+
     u8* ly;
     u8* lyc;
     u8* scy;
@@ -64,14 +152,33 @@ struct ppu {
     u8* obp1;
 
     struct obj_t* objs;
+    u8* vram;
+
+    // Where finished scanlines go, see ppu_set_output()
+    u8* outPixels;
+    int outPitch;
+    enum ppu_format_e outFormat;
+    bool outExternal;
+    u32 outColors[4];
 };
 
 void ppu_init(struct ppu*, struct gb* gb);
+void ppu_bind(struct ppu*, struct gb* gb);
+void ppu_set_output(struct ppu*, void* pixels, int pitch, enum ppu_format_e format);
+void ppu_repaint_output(struct ppu*);
+bool ppu_take_changed_lines(struct ppu*, u64 lines[PPU_LINE_WORDS]);
+void ppu_set_renderer(struct ppu*, enum ppu_renderer_e renderer);
+enum ppu_renderer_e ppu_get_renderer(const struct ppu*);
 bool ppu_run(struct ppu*, int lastCpuCycles);
 void ppu_destroy(struct ppu*);
 
 void ppu_hblank(struct ppu*);
 void ppu_vblank(struct ppu*);
+void ppu_index_objs(struct ppu*);
 void ppu_oamsearch(struct ppu*);
 void ppu_scanline(struct ppu*);
 void ppu_scanline_objs(struct ppu*);
+void ppu_commit_line(struct ppu*);
+
+void ppu_fifo_begin(struct ppu*);
+int ppu_fifo_run(struct ppu*);
@@ -0,0 +1,69 @@
+#pragma once
+#include "common.h"
+
+struct cpu;
+
+// Guest code sampling profiler. Every `period` cycles the current
+// (bank, pc) and call stack are recorded. The call stack is rebuilt
+// from CALL/RST/RET and interrupts as the cpu core executes them.
+
+#define PROFILER_DEFAULT_PERIOD 1024
+#define PROFILER_MAX_DEPTH      64
+
+// Addresses are packed as (bank << 16) | addr
+#define PROFILER_ADDR(bank, addr) (((u32)(bank) << 16) | (addr))
+
+struct profiler_frame {
+    u32 addr; // Call target
+    u16 sp;   // SP right after the return address was pushed
+};
+
+struct profiler_symbol {
+    u32 addr;
+    char* name;
+};
+
+struct profiler_stack {
+    u64 hash;
+    u32 count;
+    u32 depth;
+    u32 frames; // Offset into framePool, leaf last
+};
+
+struct profiler {
+    u32 period;
+    u64 nextSample;
+    u64 samples;
+
+    struct profiler_frame stack[PROFILER_MAX_DEPTH];
+    int depth;
+
+    // Flat histogram, open addressed on the packed address
+    u32* flatKeys;
+    u32* flatCounts;
+    u32 flatCap;
+    u32 flatUsed;
+
+    // Unique call stacks, open addressed on their hash
+    struct profiler_stack* stacks;
+    u32 stackCap;
+    u32 stackUsed;
+    u32* framePool;
+    u32 framePoolLen;
+    u32 framePoolCap;
+
+    // RGBDS symbols, sorted by address
+    struct profiler_symbol* symbols;
+    int symbolCount;
+};
+
+int profiler_init(struct profiler*, u32 period);
+void profiler_destroy(struct profiler*);
+int profiler_load_symbols(struct profiler*, const char* path);
+
+void profiler_step(struct profiler*, struct cpu* cpu, u8 opcode, u16 oldSp);
+void profiler_interrupt(struct profiler*, struct cpu* cpu);
+
+const struct profiler_symbol* profiler_lookup(struct profiler*, u32 addr);
+int profiler_write_flat(struct profiler*, const char* path);
+int profiler_write_folded(struct profiler*, const char* path);
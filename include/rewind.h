@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "gb.h"
+
+// Rewind history: one save state per frame, each stored as the XOR of
+// the previous state with the next one and then run-length compressed.
+// Compression runs on a worker thread; frames that arrive while it is
+// still busy are dropped and simply folded into the next delta.
+//
+// Pushing takes over the instance's dirty page bitmap: memory pages not
+// written since the previous snapshot aren't compared, see gb_dirty_clear().
+
+#define REWIND_PENDING 2 // Snapshots queued for the worker
+
+struct rewind_entry {
+    u8* data; // Compressed XOR of this state with the one after it
+    u32 size;
+};
+
+struct rewind {
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    bool busy;
+
+    size_t stateSize;
+    size_t memOffset;    // See gb_state_mem_offset()
+    u8* latest;          // Newest state, deltas are applied backwards from it
+    bool haveLatest;
+    u8* scratch;         // XOR of two states, worker only
+    u8* pending[REWIND_PENDING];
+    u64 pendingDirty[REWIND_PENDING][GB_PAGE_COUNT / 64]; // Pages written since the snapshot before
+    int pendingHead;
+    int pendingCount;
+
+    // Ring of deltas, oldest at first
+    struct rewind_entry* entries;
+    int maxEntries;
+    int first;
+    int count;
+    size_t bytes;
+    size_t maxBytes;
+
+    u64 dropped;         // Frames skipped because the worker was busy
+};
+
+int rewind_init(struct rewind* rw, int maxFrames, size_t maxBytes);
+void rewind_destroy(struct rewind* rw);
+void rewind_push(struct rewind* rw, struct gb* gb);
+int rewind_step_back(struct rewind* rw, struct gb* gb);
+void rewind_clear(struct rewind* rw);
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+
+#include "common.h"
+
+// ROM images are loaded once and shared, read-only, by every instance
+// running the same cartridge. On hosts with mmap the file is mapped
+// straight from the page cache, so instances cost no extra ROM memory.
+struct rom_image {
+    u8* data;
+    size_t size;
+
+    // Cache key
+    u64 device;
+    u64 inode;
+    s64 mtime;
+
+    u64 hash;    // Content hash, see romcache_hash()
+    bool hashed;
+
+    int refs;
+    bool mapped; // false if data was malloc'd
+    struct rom_image* next;
+};
+
+struct rom_image* romcache_acquire(FILE* rom);
+void romcache_retain(struct rom_image* image);
+void romcache_release(struct rom_image* image);
+u64 romcache_hash(struct rom_image* image);
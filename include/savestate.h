@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+#include "common.h"
+
+// Save states are a header followed by tagged chunks. Each chunk payload
+// is a fixed layout struct or a raw memory block and is saved with a
+// memcpy. Only states of STATE_VERSION load; bump it whenever a chunk
+// changes. States are only portable between hosts of the same byte order.
+
+#define STATE_MAGIC   "DJSTATE"
+#define STATE_VERSION 1
+
+// Start of the memory saved in a state, everything below is ROM
+#define STATE_MEM_START 0x8000
+#define STATE_MEM_SIZE  (0x10000 - STATE_MEM_START)
+
+struct gb;
+
+// Only depends on the cartridge, not on what the instance is doing
+size_t gb_state_size(const struct gb* gb);
+size_t gb_state_save(const struct gb* gb, u8* buf);
+// Where memory from STATE_MEM_START is stored in a state, a raw copy of it
+size_t gb_state_mem_offset(const struct gb* gb);
+int gb_state_load(struct gb* gb, const u8* buf, size_t size);
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+#include "common.h"
+
+// Named checkpoints (title screen, level start...) saved per ROM, so new
+// instances can start from them instead of emulating their way there.
+// Files are named <dir>/<rom hash>-<name>.djstate and are memory-mapped
+// read-only, so every process restoring a checkpoint shares its pages.
+
+#define SNAPSHOT_DEFAULT_DIR ".dijon-snapshots"
+#define SNAPSHOT_EXTENSION   ".djstate"
+
+struct gb;
+
+struct snapshot {
+    const u8* data;
+    size_t size;
+    bool mapped; // false if data was malloc'd
+};
+
+int snapshot_store(const char* dir, const struct gb* gb, const char* name);
+int snapshot_open(struct snapshot* s, const char* dir, const struct gb* gb, const char* name);
+int snapshot_restore(const struct snapshot* s, struct gb* gb);
+void snapshot_close(struct snapshot* s);
@@ -0,0 +1,54 @@
+#pragma once
+#include "common.h"
+
+struct gb;
+
+// Decoded pictures of VRAM and OAM for debug viewers, kept up to date
+// incrementally. Each update compares VRAM against the copy it saw last
+// time and only redraws the tiles, map entries and objects that changed,
+// so a static screen costs a few memcmps. Palette or addressing mode
+// changes redraw everything.
+
+#define TILECACHE_TILES 384
+
+// All 384 tiles, 16 to a row
+#define TILECACHE_TILES_W 128
+#define TILECACHE_TILES_H 192
+// A whole 32x32 tile map
+#define TILECACHE_MAP_W 256
+#define TILECACHE_MAP_H 256
+// The 40 objects as 8x16 cells, 8 to a row
+#define TILECACHE_OBJS_W 64
+#define TILECACHE_OBJS_H 80
+
+struct tilecache {
+    bool primed; // Something was drawn since init
+
+    // What the pictures were drawn from
+    u8 vram[0x2000];
+    u8 oam[0xA0];
+    u8 bgp;
+    u8 obp0;
+    u8 obp1;
+    bool unsignedTiles; // LCDC.4, BG and window tiles from 8000h
+    bool obj8x16;
+
+    u8 tilePixels[TILECACHE_TILES][64]; // Colour indices
+    u64 dirtyTiles[TILECACHE_TILES / 64];
+
+    // ARGB8888 pictures in gColors. Objects are transparent where their
+    // colour is 0. Maps are the 9800h and 9C00h ones, whichever LCDC uses
+    u32* tiles;
+    u32* maps[2];
+    u32* objs;
+
+    // Set when a picture is redrawn, for the frontend to clear once it
+    // has uploaded it
+    bool tilesChanged;
+    bool mapsChanged[2];
+    bool objsChanged;
+};
+
+int tilecache_init(struct tilecache*);
+void tilecache_update(struct tilecache*, struct gb* gb);
+void tilecache_destroy(struct tilecache*);
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+
+struct cpu;
+
+#define TRACE_MAGIC       "DJTRACE"
+#define TRACE_VERSION     1
+// Must be a power of two
+#define TRACE_RING_SIZE   (1 << 16)
+
+struct trace_header {
+    char magic[8];
+    u32 version;
+    u32 recordSize;
+};
+
+// One executed instruction, captured before it runs. Fixed size
+// so the ring buffer and trace files can be indexed directly
+struct trace_record {
+    u64 cycle;
+    u16 pc;
+    u16 sp;
+    u16 bank;   // ROM bank mapped at pc, 0 for the fixed bank
+    u8 a, f, b, c, d, e, h, l;
+    u8 mem[4];  // Bytes at pc (opcode + operands)
+    u8 reserved[6];
+};
+
+// Single-producer/single-consumer ring. The emulator thread pushes
+// records, a background thread streams them to disk
+struct tracer {
+    FILE* file;
+    struct trace_record* ring;
+    pthread_t writer;
+    atomic_bool running;
+
+    _Alignas(64) atomic_ullong head; // Written by the emulator
+    u64 cachedTail;
+    _Alignas(64) atomic_ullong tail; // Written by the writer thread
+};
+
+int trace_init(struct tracer*, const char* path);
+void trace_destroy(struct tracer*);
+void trace_push(struct tracer*, struct cpu* cpu);
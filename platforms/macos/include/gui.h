@@ -1,16 +1,60 @@
 #pragma once
 #include "common.h"
+#include "rewind.h"
+#include "tilecache.h"
 typedef struct SDL_Window SDL_Window;
 typedef struct SDL_Renderer SDL_Renderer;
 typedef struct SDL_Texture SDL_Texture;
 
+// About an hour of rewind history, if it fits in the memory budget
+#define GUI_REWIND_FRAMES (60 * 60 * 60)
+#define GUI_REWIND_BYTES  ((size_t) 512 << 20)
+
+// Emulated frames kept in the frame time histogram
+#define GUI_FRAMETIME_HISTORY 180
+
 struct gb;
 struct gui {
     SDL_Window *win;
     SDL_Renderer *ren;
     SDL_Texture *gameTex;
+    u32 gamePixels[160 * 144]; // The PPU draws here, see gui_upload_game_tex()
+
+    // Debug viewers from the Debug menu, drawn from the tile cache while
+    // any of them is open
+    struct tilecache tileCache;
+    bool tileCacheReady;
+    bool showBGMap, showWinMap, showTiles, showOAM;
+    SDL_Texture *tilesTex;
+    SDL_Texture *mapTex[2];
+    SDL_Texture *objsTex;
 
     u64 lastUpdateTicks;
+
+    // Backspace steps back a frame
+    struct rewind rewind;
+    bool rewindEnabled;
+    bool rewindExhausted; // Stepped back past the oldest frame
+
+    // F6 stores the current state as a checkpoint, see snapshot.h
+    const char* snapshotDir;
+    const char* checkpoint;
+
+    // F5 quick save, F8 quick load
+    u8* quickState;
+    size_t quickStateSize;
+
+    // Performance panel, averaged over the last sample period
+    float frameTimes[GUI_FRAMETIME_HISTORY]; // ms
+    int frameTimesNext;
+    u64 guiNs;           // Time spent rendering the gui since the last sample
+    u64 sampleStart;
+    u64 sampleFrames;
+    u64 sampleInstructions;
+    u64 samplePpuNs;
+    float speed;         // % of 59.7 Hz
+    float instrPerSec;
+    float cpuMs, ppuMs, presentMs; // Per emulated frame
 };
 
 int gui_init(struct gui* gui);
@@ -4,11 +4,15 @@
 #include "cimgui.h"
 #include "cimgui_impl.h"
 #include <SDL2/SDL.h>
+#include <stdlib.h>
 
 #include "gui.h"
 #include "gb.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "hostprof.h"
+#include "savestate.h"
+#include "snapshot.h"
 
 
 int gui_init(struct gui* gui) {
@@ -21,6 +25,19 @@ int gui_init(struct gui* gui) {
     gui->ren = SDL_CreateRenderer(gui->win, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
     gui->gameTex = SDL_CreateTexture(gui->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
 
+    gui->tileCacheReady = (tilecache_init(&gui->tileCache) == 0);
+    gui->showBGMap = gui->showWinMap = gui->showTiles = gui->showOAM = false;
+    gui->tilesTex = SDL_CreateTexture(gui->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                      TILECACHE_TILES_W, TILECACHE_TILES_H);
+    for(int m = 0; m < 2; m++) {
+        gui->mapTex[m] = SDL_CreateTexture(gui->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                           TILECACHE_MAP_W, TILECACHE_MAP_H);
+    }
+    // Objects are transparent where their colour is 0
+    gui->objsTex = SDL_CreateTexture(gui->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                     TILECACHE_OBJS_W, TILECACHE_OBJS_H);
+    SDL_SetTextureBlendMode(gui->objsTex, SDL_BLENDMODE_BLEND);
+
 
     igCreateContext(NULL);
     ImGuiIO *io = igGetIO();
@@ -33,10 +50,36 @@ int gui_init(struct gui* gui) {
 
     gui->lastUpdateTicks = SDL_GetTicks64();
 
+    gui->quickState = NULL;
+    gui->quickStateSize = 0;
+    gui->snapshotDir = SNAPSHOT_DEFAULT_DIR;
+    gui->checkpoint = "start";
+    gui->rewindEnabled = (rewind_init(&gui->rewind, GUI_REWIND_FRAMES, GUI_REWIND_BYTES) == 0);
+    gui->rewindExhausted = false;
+
+    memset(gui->frameTimes, 0, sizeof(gui->frameTimes));
+    gui->frameTimesNext = 0;
+    gui->guiNs = 0;
+    gui->sampleStart = hostprof_now();
+    gui->sampleFrames = 0;
+    gui->sampleInstructions = 0;
+    gui->samplePpuNs = 0;
+    gui->speed = 0.0f;
+    gui->instrPerSec = 0.0f;
+    gui->cpuMs = gui->ppuMs = gui->presentMs = 0.0f;
+
     return 0;
 }
 
 void gui_destroy(struct gui* gui) {
+    free(gui->quickState);
+    if(gui->rewindEnabled) {
+        rewind_destroy(&gui->rewind);
+    }
+    if(gui->tileCacheReady) {
+        tilecache_destroy(&gui->tileCache);
+    }
+
     ImGui_ImplSDLRenderer2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     igDestroyContext(NULL);
@@ -46,14 +89,247 @@ void gui_destroy(struct gui* gui) {
     SDL_Quit();
 }
 
+// Turns the core's counters into rates every half second
+static void gui_sample_perf(struct gui* gui, struct gb* gb) {
+    u64 now = hostprof_now();
+    u64 elapsed = now - gui->sampleStart;
+    if(elapsed < 500000000ULL) {
+        return;
+    }
+
+    u64 frames = gb->perf.frames - gui->sampleFrames;
+    u64 instructions = gb->perf.instructions - gui->sampleInstructions;
+    u64 ppuNs = gb->perf.ppuNs - gui->samplePpuNs;
+    // Whatever isn't spent on scanlines or the gui is spent emulating the cpu
+    u64 otherNs = ppuNs + gui->guiNs;
+    u64 cpuNs = (elapsed > otherNs)? elapsed - otherNs : 0;
+
+    double seconds = elapsed / 1e9;
+    gui->speed = (float)(frames / seconds / GB_FRAMERATE * 100.0);
+    gui->instrPerSec = (float)(instructions / seconds);
+    if(frames > 0) {
+        gui->cpuMs = cpuNs / 1e6f / frames;
+        gui->ppuMs = ppuNs / 1e6f / frames;
+        gui->presentMs = gui->guiNs / 1e6f / frames;
+    }
+
+    gui->sampleStart = now;
+    gui->sampleFrames = gb->perf.frames;
+    gui->sampleInstructions = gb->perf.instructions;
+    gui->samplePpuNs = gb->perf.ppuNs;
+    gui->guiNs = 0;
+}
+
+static void gui_render_perf(struct gui* gui, struct gb* gb) {
+    igBegin("Performance", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+        if(gui->speed < 99.5f) {
+            igTextColored((ImVec4){1.0f, 0.35f, 0.3f, 1.0f}, "Speed: %.1f%% (below real time)", gui->speed);
+        } else {
+            igText("Speed: %.1f%%", gui->speed);
+        }
+        igText("Instructions/sec: %.2fM", gui->instrPerSec / 1e6f);
+
+        char overlay[32];
+        int last = (gui->frameTimesNext + GUI_FRAMETIME_HISTORY - 1) % GUI_FRAMETIME_HISTORY;
+        snprintf(overlay, sizeof(overlay), "%.2f ms", gui->frameTimes[last]);
+        igPlotHistogram_FloatPtr("Frame time", gui->frameTimes, GUI_FRAMETIME_HISTORY, gui->frameTimesNext,
+                                 overlay, 0.0f, 2000.0f / GB_FRAMERATE, (ImVec2){0, 60}, sizeof(float));
+
+        float total = gui->cpuMs + gui->ppuMs + gui->presentMs;
+        if(total <= 0.0f) {
+            total = 1.0f;
+        }
+        igSeparatorText("Per frame");
+        // Untimed, the PPU counts as cpu time
+        igCheckbox("Time the PPU", &gb->perf.timePpu);
+        snprintf(overlay, sizeof(overlay), gb->perf.timePpu? "CPU %.2f ms" : "CPU+PPU %.2f ms", gui->cpuMs);
+        igProgressBar(gui->cpuMs / total, (ImVec2){200, 0}, overlay);
+        if(gb->perf.timePpu) {
+            snprintf(overlay, sizeof(overlay), "PPU %.2f ms", gui->ppuMs);
+            igProgressBar(gui->ppuMs / total, (ImVec2){200, 0}, overlay);
+        }
+        snprintf(overlay, sizeof(overlay), "Present %.2f ms", gui->presentMs);
+        igProgressBar(gui->presentMs / total, (ImVec2){200, 0}, overlay);
+
+        igSeparatorText("Renderer");
+        enum ppu_renderer_e renderer = ppu_get_renderer(gb->ppu);
+        for(int r = 0; r < PPU_RENDERER_COUNT; r++) {
+            if(igRadioButton_Bool(gPPURenderers[r].name, renderer == r)) {
+                ppu_set_renderer(gb->ppu, (enum ppu_renderer_e) r);
+            }
+        }
+
+        if(gui->rewindEnabled) {
+            igSeparatorText("Rewind");
+            igText("%d frames, %.1f MB", gui->rewind.count, gui->rewind.bytes / (1024.0f * 1024.0f));
+            if(gui->rewindExhausted) {
+                igText("No more history");
+            }
+        }
+    igEnd();
+}
+
+// The PPU draws the lines that change straight into gamePixels, and only
+// runs of those rows are uploaded; nothing at all if the picture is the
+// same. The texture itself is never left locked, so it can always be drawn
+static void gui_upload_game_tex(struct gui* gui, struct gb* gb) {
+    if(gb->ppu->outPixels != (u8*) gui->gamePixels) {
+        // A new instance, or one that drew elsewhere. Repainting reports
+        // every line as changed, so the whole picture goes up once
+        ppu_set_output(gb->ppu, gui->gamePixels, 160 * sizeof(u32), PPU_FORMAT_ARGB8888);
+        ppu_repaint_output(gb->ppu);
+    }
+
+    u64 lines[PPU_LINE_WORDS];
+    if(!ppu_take_changed_lines(gb->ppu, lines)) {
+        return;
+    }
+    int y = 0;
+    while(y < 144) {
+        if(!((lines[y >> 6] >> (y & 63)) & 1)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while(y < 144 && ((lines[y >> 6] >> (y & 63)) & 1)) {
+            y++;
+        }
+        SDL_Rect rows = { 0, first, 160, y - first };
+        SDL_UpdateTexture(gui->gameTex, &rows, gui->gamePixels + first * 160, 160 * sizeof(u32));
+    }
+}
+
+// Brings the tile cache up to date and uploads the pictures it redrew.
+// Costs nothing while the viewers are closed
+static void gui_upload_viewers(struct gui* gui, struct gb* gb) {
+    struct tilecache* tc = &gui->tileCache;
+    if(!gui->tileCacheReady || !(gui->showBGMap || gui->showWinMap || gui->showTiles || gui->showOAM)) {
+        return;
+    }
+    tilecache_update(tc, gb);
+
+    if(tc->tilesChanged) {
+        SDL_UpdateTexture(gui->tilesTex, NULL, tc->tiles, TILECACHE_TILES_W * sizeof(u32));
+        tc->tilesChanged = false;
+    }
+    for(int m = 0; m < 2; m++) {
+        if(tc->mapsChanged[m]) {
+            SDL_UpdateTexture(gui->mapTex[m], NULL, tc->maps[m], TILECACHE_MAP_W * sizeof(u32));
+            tc->mapsChanged[m] = false;
+        }
+    }
+    if(tc->objsChanged) {
+        SDL_UpdateTexture(gui->objsTex, NULL, tc->objs, TILECACHE_OBJS_W * sizeof(u32));
+        tc->objsChanged = false;
+    }
+}
+
+static void gui_image(SDL_Texture* tex, float w, float h) {
+    igImage((ImTextureID) tex,
+            (ImVec2){w, h},
+            (ImVec2){0.0f, 0.0f},
+            (ImVec2){1.0f, 1.0f},
+            (ImVec4){1.0f, 1.0f, 1.0f, 1.0f},
+            (ImVec4){1.0f, 1.0f, 1.0f, 0.0f});
+}
+
+// Outlines w x h pixels from x, y of a map image at origin, wrapping
+// around its edges like the PPU does
+static void gui_outline_map(ImVec2 origin, int x, int y, int w, int h) {
+    ImDrawList* draw = igGetWindowDrawList();
+    ImVec2 end = { origin.x + TILECACHE_MAP_W, origin.y + TILECACHE_MAP_H };
+    ImDrawList_PushClipRect(draw, origin, end, true);
+    for(int dy = 0; dy <= TILECACHE_MAP_H; dy += TILECACHE_MAP_H) {
+        for(int dx = 0; dx <= TILECACHE_MAP_W; dx += TILECACHE_MAP_W) {
+            ImVec2 min = { origin.x + x - dx, origin.y + y - dy };
+            ImVec2 max = { min.x + w, min.y + h };
+            // Opaque red, imgui colours are ABGR
+            ImDrawList_AddRect(draw, min, max, 0xFF2020FF, 0.0f, 0, 1.0f);
+        }
+    }
+    ImDrawList_PopClipRect(draw);
+}
+
+static void gui_render_bg_map(struct gui* gui, struct gb* gb) {
+    struct ppu* ppu = gb->ppu;
+    igBegin("BG map", &gui->showBGMap, ImGuiWindowFlags_AlwaysAutoResize);
+        int map = ppu->lcdc->bgMapArea;
+        igText("%s, SCX %d, SCY %d", map? "9C00h" : "9800h", *ppu->scx, *ppu->scy);
+        ImVec2 origin;
+        igGetCursorScreenPos(&origin);
+        gui_image(gui->mapTex[map], TILECACHE_MAP_W, TILECACHE_MAP_H);
+        gui_outline_map(origin, *ppu->scx, *ppu->scy, 160, 144);
+    igEnd();
+}
+
+static void gui_render_win_map(struct gui* gui, struct gb* gb) {
+    struct ppu* ppu = gb->ppu;
+    igBegin("Window map", &gui->showWinMap, ImGuiWindowFlags_AlwaysAutoResize);
+        int map = ppu->lcdc->winMapArea;
+        igText("%s, WX %d, WY %d%s", map? "9C00h" : "9800h", *ppu->wx, *ppu->wy,
+               ppu->lcdc->windowOn? "" : ", off");
+        ImVec2 origin;
+        igGetCursorScreenPos(&origin);
+        gui_image(gui->mapTex[map], TILECACHE_MAP_W, TILECACHE_MAP_H);
+        // The window shows its map from the top left corner
+        int w = 167 - *ppu->wx;
+        int h = 144 - *ppu->wy;
+        if(ppu->lcdc->windowOn && w > 0 && h > 0) {
+            gui_outline_map(origin, 0, 0, (w < 160)? w : 160, h);
+        }
+    igEnd();
+}
+
+static void gui_render_tiles(struct gui* gui, struct gb* gb) {
+    igBegin("Tiles", &gui->showTiles, ImGuiWindowFlags_AlwaysAutoResize);
+        igText("8000h-97FFh, BG tiles from %s", gb->ppu->lcdc->bgTilesArea? "8000h" : "8800h");
+        gui_image(gui->tilesTex, TILECACHE_TILES_W * 2, TILECACHE_TILES_H * 2);
+    igEnd();
+}
+
+static void gui_render_oam(struct gui* gui, struct gb* gb) {
+    struct ppu* ppu = gb->ppu;
+    igBegin("OAM", &gui->showOAM, ImGuiWindowFlags_AlwaysAutoResize);
+        gui_image(gui->objsTex, TILECACHE_OBJS_W * 2, TILECACHE_OBJS_H * 2);
+        ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY;
+        if(igBeginTable("objs", 5, flags, (ImVec2){0, 240}, 0.0f)) {
+            igTableSetupColumn("#", 0, 0.0f, 0);
+            igTableSetupColumn("X", 0, 0.0f, 0);
+            igTableSetupColumn("Y", 0, 0.0f, 0);
+            igTableSetupColumn("Tile", 0, 0.0f, 0);
+            igTableSetupColumn("Flags", 0, 0.0f, 0);
+            igTableHeadersRow();
+            for(int o = 0; o < 40; o++) {
+                struct obj_t* obj = &ppu->objs[o];
+                igTableNextRow(0, 0.0f);
+                igTableNextColumn(); igText("%d", o);
+                igTableNextColumn(); igText("%d", obj->x);
+                igTableNextColumn(); igText("%d", obj->y);
+                igTableNextColumn(); igText("%02X", obj->chr);
+                igTableNextColumn(); igText("OBP%d%s%s%s", obj->attr.dmgPal, obj->attr.xFlip? " X" : "",
+                                            obj->attr.yFlip? " Y" : "", obj->attr.priority? " BG" : "");
+            }
+            igEndTable();
+        }
+    igEnd();
+}
+
 void gui_render(struct gui* gui, struct gb* gb, bool frameCompleted) {
 
+    if(frameCompleted) {
+        gui->frameTimes[gui->frameTimesNext] = gb->perf.lastFrameNs / 1e6f;
+        gui->frameTimesNext = (gui->frameTimesNext + 1) % GUI_FRAMETIME_HISTORY;
+    }
+    gui_sample_perf(gui, gb);
+
     // Every 1/60th of a second, refresh the gui
     u64 newUpdateTicks = SDL_GetTicks64();
     if(newUpdateTicks - gui->lastUpdateTicks >= (1000 / 60.0F)) {
 
         gui->lastUpdateTicks = newUpdateTicks;
 
+        u64 renderStart = hostprof_now();
+        u64 imguiProbe = hostprof_begin();
         ImGui_ImplSDLRenderer2_NewFrame();
         ImGui_ImplSDL2_NewFrame();
         igNewFrame();
@@ -63,15 +339,20 @@ void gui_render(struct gui* gui, struct gb* gb, bool frameCompleted) {
                 igMenuItem_Bool("Open ROM", "O", false, true);
                 igEndMenu();
             }
+            if(igBeginMenu("Debug", gui->tileCacheReady)) {
+                igMenuItem_BoolPtr("BG map", NULL, &gui->showBGMap, true);
+                igMenuItem_BoolPtr("Window map", NULL, &gui->showWinMap, true);
+                igMenuItem_BoolPtr("Tiles", NULL, &gui->showTiles, true);
+                igMenuItem_BoolPtr("OAM", NULL, &gui->showOAM, true);
+                igEndMenu();
+            }
             igEndMainMenuBar();
         }
 
         igBegin("Main view", NULL, ImGuiWindowFlags_AlwaysAutoResize);
-            u32 *textureBuffer;
-            int pitch;
-            SDL_LockTexture(gui->gameTex, NULL, (void**)&textureBuffer, &pitch);
-            memcpy(textureBuffer, gb->ppu->framebuffer, 160 * 144 * sizeof(u32));
-            SDL_UnlockTexture(gui->gameTex);
+            u64 uploadProbe = hostprof_begin();
+            gui_upload_game_tex(gui, gb);
+            hostprof_end(HOSTPROF_TEXTURE_UPLOAD, uploadProbe);
         igImage((ImTextureID) gui->gameTex,
                 (ImVec2){160, 144},
                 (ImVec2){0.0f, 0.0f},
@@ -80,12 +361,74 @@ void gui_render(struct gui* gui, struct gb* gb, bool frameCompleted) {
                 (ImVec4){1.0f, 1.0f, 1.0f, 0.0f});
         igEnd();
 
+        gui_render_perf(gui, gb);
+
+        gui_upload_viewers(gui, gb);
+        if(gui->showBGMap)
+            gui_render_bg_map(gui, gb);
+        if(gui->showWinMap)
+            gui_render_win_map(gui, gb);
+        if(gui->showTiles)
+            gui_render_tiles(gui, gb);
+        if(gui->showOAM)
+            gui_render_oam(gui, gb);
+
         igRender();
         SDL_SetRenderDrawColor(gui->ren, 0x73, 0x8C, 0x99, 0xFF);
         SDL_RenderClear(gui->ren);
 
         ImGui_ImplSDLRenderer2_RenderDrawData(igGetDrawData(), gui->ren);
+        hostprof_end(HOSTPROF_IMGUI, imguiProbe);
+
+        u64 presentProbe = hostprof_begin();
         SDL_RenderPresent(gui->ren);
+        hostprof_end(HOSTPROF_PRESENT, presentProbe);
+
+        gui->guiNs += hostprof_now() - renderStart;
+    }
+}
+
+// F9 starts a host profile capture, pressing it again saves it
+static void gui_toggle_hostprof() {
+    if(atomic_load(&gHostprofCapturing)) {
+        hostprof_stop();
+        hostprof_write_json("dijon_hostprof.json");
+    } else {
+        printf("Capturing host profile, press F9 again to save it\n");
+        hostprof_start();
+    }
+}
+
+// Pauses and steps back one frame, held down it keeps rewinding
+static void gui_step_back(struct gui* gui, struct gb* gb) {
+    if(!gui->rewindEnabled) {
+        return;
+    }
+    cpu_set_paused(gb->cpu, true);
+    gui->rewindExhausted = (rewind_step_back(&gui->rewind, gb) < 0);
+}
+
+static void gui_quick_save(struct gui* gui, struct gb* gb) {
+    size_t size = gb_state_size(gb);
+    if(size > gui->quickStateSize) {
+        u8* state = (u8*) realloc(gui->quickState, size);
+        if(state == NULL) {
+            printf("Error: Not enough memory for a save state!\n");
+            return;
+        }
+        gui->quickState = state;
+    }
+    gui->quickStateSize = gb_state_save(gb, gui->quickState);
+    printf("Saved state\n");
+}
+
+static void gui_quick_load(struct gui* gui, struct gb* gb) {
+    if(gui->quickState == NULL) {
+        printf("No state saved yet, press F5 to save one\n");
+        return;
+    }
+    if(gb_state_load(gb, gui->quickState, gui->quickStateSize) == 0) {
+        printf("Loaded state\n");
     }
 }
 
@@ -99,7 +442,12 @@ void gui_update(struct gui* gui, struct gb* gb, bool* stopped, bool frameComplet
         }
         else if (e.type == SDL_KEYDOWN) {
             switch(e.key.keysym.sym) {
-                case SDLK_SPACE: gb->cpu->paused = !gb->cpu->paused; break;
+                case SDLK_SPACE: cpu_set_paused(gb->cpu, !gb->cpu->paused); break;
+                case SDLK_BACKSPACE: gui_step_back(gui, gb);      break;
+                case SDLK_F5:     gui_quick_save(gui, gb);        break;
+                case SDLK_F6:     snapshot_store(gui->snapshotDir, gb, gui->checkpoint); break;
+                case SDLK_F8:     gui_quick_load(gui, gb);        break;
+                case SDLK_F9:     gui_toggle_hostprof();          break;
                 case SDLK_w:      gb_keypress(gb, GB_KEY_UP);     break;
                 case SDLK_a:      gb_keypress(gb, GB_KEY_LEFT);   break;
                 case SDLK_s:      gb_keypress(gb, GB_KEY_DOWN);   break;
@@ -124,5 +472,10 @@ void gui_update(struct gui* gui, struct gb* gb, bool* stopped, bool frameComplet
         }
     }
 
+    if(frameCompleted && gui->rewindEnabled && !gb->cpu->paused) {
+        rewind_push(&gui->rewind, gb);
+        gui->rewindExhausted = false;
+    }
+
     gui_render(gui, gb, frameCompleted);
 }
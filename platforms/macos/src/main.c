@@ -1,56 +1,97 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "gb.h"
 #include "cpu.h"
+#include "ppu.h"
 #include "gui.h"
+#include "trace.h"
+#include "profiler.h"
+#include "hostprof.h"
+#include "snapshot.h"
 
 
 int main(int argc, char** argv) {
 
     struct gb gb;
     struct gui gui;
+    struct tracer tracer;
+    bool tracing = false;
+    const char* statsPath = NULL;
+    struct profiler profiler;
+    const char* profilePath = NULL;
+    const char* checkpoint = NULL;
+    bool fifoRenderer = false;
 
     if(argc < 2) {
-        printf("You must include a bootrom PATH in the arguments!\n");
+        printf("Usage: %s [path_to_bootrom.bin] <path_to_rom.gb> [options]\n", argv[0]);
         return 1;
     }
 
+    // With a single path, boot straight into the rom without a bootrom
+    bool haveBootrom = (argc > 2 && argv[2][0] != '-');
+    const char* romPath = argv[haveBootrom? 2 : 1];
+    int firstOption = haveBootrom? 3 : 2;
+
     gb_init(&gb);
 
-    FILE* bootrom;
-    if((bootrom = fopen(argv[1], "rb")) == NULL) {
-        printf("Error opening bootrom file!\n");
-        // Destroy everything and abort
-        gb_destroy(&gb);
-        return 1;
-    }
-    fseek(bootrom, 0L, SEEK_END);
-    long size = ftell(bootrom);
-    rewind(bootrom);
-    if(size != 256) {
-        printf("Wrong size bootrom!\n");
-        // Destroy everything and abort
-        gb_destroy(&gb);
-        return 1;
-    }
+    if(haveBootrom) {
+        FILE* bootrom;
+        if((bootrom = fopen(argv[1], "rb")) == NULL) {
+            printf("Error opening bootrom file!\n");
+            // Destroy everything and abort
+            gb_destroy(&gb);
+            return 1;
+        }
+        fseek(bootrom, 0L, SEEK_END);
+        long size = ftell(bootrom);
+        rewind(bootrom);
+        if(size != 256) {
+            printf("Wrong size bootrom!\n");
+            // Destroy everything and abort
+            fclose(bootrom);
+            gb_destroy(&gb);
+            return 1;
+        }
 
-    gb_readBootrom(&gb, bootrom);
-    fclose(bootrom);
+        gb_readBootrom(&gb, bootrom);
+        fclose(bootrom);
+    }
 
     FILE* rom;
-    if((rom = fopen(argv[2], "rb")) == NULL) {
+    if((rom = fopen(romPath, "rb")) == NULL) {
         printf("Error opening rom file!\n");
         // Destroy everything and abort
         gb_destroy(&gb);
         return 1;
     }
 
-    gb_readRom(&gb, rom);
+    // The ROM stays mapped after the file is closed
+    if(gb_readRom(&gb, rom) < 0) {
+        fclose(rom);
+        gb_destroy(&gb);
+        return 1;
+    }
     fclose(rom);
 
-    if(argc > 3) {
-        for(int i = 3; i < argc; i++) {
+    // Battery RAM lives in game.sav next to game.gb
+    if(gb.cart.battery) {
+        char savPath[1024];
+        snprintf(savPath, sizeof(savPath), "%s", romPath);
+        char* ext = strrchr(savPath, '.');
+        if(ext != NULL && strchr(ext, '/') == NULL)
+            *ext = '\0';
+        strncat(savPath, ".sav", sizeof(savPath) - strlen(savPath) - 1);
+        gb_load_sav(&gb, savPath);
+    }
+
+    if(!haveBootrom) {
+        gb_skip_bootrom(&gb);
+    }
+
+    if(argc > firstOption) {
+        for(int i = firstOption; i < argc; i++) {
             if(argv[i][0] == '-') {
                 switch(argv[i][1]) {
                     case 'v':
@@ -59,17 +100,95 @@ int main(int argc, char** argv) {
                     case 'b':
                         cpu_set_stop_at_bootrom(gb.cpu, true);
                         break;
+                    case 'f':
+                        fifoRenderer = true;
+                        break;
+                    case 't':
+                        if(i + 1 >= argc) {
+                            printf("-t requires a trace file PATH!\n");
+                            break;
+                        }
+                        if(trace_init(&tracer, argv[++i]) == 0) {
+                            tracing = true;
+                            cpu_set_tracer(gb.cpu, &tracer);
+                        }
+                        break;
+                    case 'c':
+                        if(i + 1 >= argc) {
+                            printf("-c requires a checkpoint NAME!\n");
+                            break;
+                        }
+                        checkpoint = argv[++i];
+                        break;
+                    case 's':
+                        if(i + 1 >= argc) {
+                            printf("-s requires an output PATH!\n");
+                            break;
+                        }
+                        statsPath = argv[++i];
+                        break;
+                    case 'p':
+                        if(i + 1 >= argc) {
+                            printf("-p requires an output PATH!\n");
+                            break;
+                        }
+                        // Take the PATH even if the profiler can't start, so it isn't read as an option
+                        i++;
+                        if(profiler_init(&profiler, PROFILER_DEFAULT_PERIOD) == 0) {
+                            profilePath = argv[i];
+                            // RGBDS writes game.sym next to game.gb
+                            char symPath[1024];
+                            snprintf(symPath, sizeof(symPath), "%s", romPath);
+                            char* ext = strrchr(symPath, '.');
+                            if(ext != NULL && strchr(ext, '/') == NULL)
+                                *ext = '\0';
+                            strncat(symPath, ".sym", sizeof(symPath) - strlen(symPath) - 1);
+                            profiler_load_symbols(&profiler, symPath);
+                            cpu_set_profiler(gb.cpu, &profiler);
+                        }
+                        break;
                 }
             }
         }
     }
 
+    // Start from the checkpoint if one was stored for this rom
+    const char* snapshotDir = getenv("DIJON_SNAPSHOT_DIR");
+    if(snapshotDir == NULL) {
+        snapshotDir = SNAPSHOT_DEFAULT_DIR;
+    }
+    if(checkpoint != NULL) {
+        struct snapshot snapshot;
+        if(snapshot_open(&snapshot, snapshotDir, &gb, checkpoint) == 0) {
+            if(snapshot_restore(&snapshot, &gb) == 0) {
+                printf("Started from checkpoint %s\n", checkpoint);
+            }
+            snapshot_close(&snapshot);
+        } else {
+            printf("No checkpoint %s yet, press F6 to store one\n", checkpoint);
+        }
+    }
+
+    // After the checkpoint, whose state carries the renderer it was made with
+    if(fifoRenderer) {
+        ppu_set_renderer(gb.ppu, PPU_RENDERER_FIFO);
+    }
+
     // Create the gui
     if(gui_init(&gui) < 0) {
+        if(tracing) {
+            trace_destroy(&tracer);
+        }
+        if(profilePath != NULL) {
+            profiler_destroy(&profiler);
+        }
         gb_destroy(&gb);
         return 1;
     }
     
+    gui.snapshotDir = snapshotDir;
+    gui.checkpoint = (checkpoint != NULL)? checkpoint : "start";
+
     bool sdlStopped = false;
     bool gbStopped = false;
     // Main loop
@@ -83,8 +202,31 @@ int main(int argc, char** argv) {
 
     // Destroy the gui
     gui_destroy(&gui);
+    if(statsPath != NULL) {
+#ifdef DIJON_OPCODE_STATS
+        opstats_write(gb.cpu, statsPath);
+#else
+        printf("Warning: built without DIJON_OPCODE_STATS, no opcode stats written!\n");
+#endif
+    }
+    // Write the guest profile as <path>.txt and <path>.folded
+    if(profilePath != NULL) {
+        char outPath[1024];
+        snprintf(outPath, sizeof(outPath), "%s.txt", profilePath);
+        profiler_write_flat(&profiler, outPath);
+        snprintf(outPath, sizeof(outPath), "%s.folded", profilePath);
+        profiler_write_folded(&profiler, outPath);
+        cpu_set_profiler(gb.cpu, NULL);
+        profiler_destroy(&profiler);
+    }
+    // Flush the trace
+    if(tracing) {
+        cpu_set_tracer(gb.cpu, NULL);
+        trace_destroy(&tracer);
+    }
     // Destroy emulator instance
     gb_destroy(&gb);
+    hostprof_destroy();
 
     return 0;
 }
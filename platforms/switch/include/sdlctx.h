@@ -2,6 +2,7 @@
 #include <SDL2/SDL.h>
 
 #include "common.h"
+#include "tilecache.h"
 
 struct gb;
 
@@ -25,9 +26,17 @@ struct window_t
 struct sdlctx {
     struct window_t windows[WINDOW_COUNT];
 
+    // The BG map viewer, see sdlctx_renderBGMapWindow()
+    struct tilecache tiles;
+    bool tilesReady;
+    int bgMapShown; // Which map and viewport are on screen, -1 for none
+    u8 bgMapScx;
+    u8 bgMapScy;
+
     u64 lastUpdateTicks;
 };
 
 int sdlctx_init(struct sdlctx* ctx);
+void sdlctx_attach(struct sdlctx* ctx, struct gb* gb);
 void sdlctx_update(struct sdlctx* ctx, bool* stopped, bool frameCompleted, struct gb* gb);
 void sdlctx_destroy(struct sdlctx* ctx);
\ No newline at end of file
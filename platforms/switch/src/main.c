@@ -22,26 +22,25 @@ int main(int argc, char** argv) {
 
     gb_init(&gb);
 
-    FILE* bootrom;
-    if((bootrom = fopen("/bootrom.bin", "rb")) == NULL) {
-        printf("Error opening bootrom file!\n");
-        // Destroy everything and abort
-        gb_destroy(&gb);
-        return 1;
-    }
-    fseek(bootrom, 0L, SEEK_END);
-    long size = ftell(bootrom);
-    rewind(bootrom);
-    if(size != 256) {
-        printf("Wrong size bootrom!\n");
-        // Destroy everything and abort
-        gb_destroy(&gb);
-        return 1;
+    // Without a bootrom, boot straight into the rom
+    FILE* bootrom = fopen("/bootrom.bin", "rb");
+    bool haveBootrom = (bootrom != NULL);
+    if(haveBootrom) {
+        fseek(bootrom, 0L, SEEK_END);
+        long size = ftell(bootrom);
+        rewind(bootrom);
+        if(size != 256) {
+            printf("Wrong size bootrom!\n");
+            // Destroy everything and abort
+            fclose(bootrom);
+            gb_destroy(&gb);
+            return 1;
+        }
+
+        gb_readBootrom(&gb, bootrom);
+        fclose(bootrom);
     }
 
-    gb_readBootrom(&gb, bootrom);
-    fclose(bootrom);
-
     FILE* rom;
     if((rom = fopen("/tetris.gb", "rb")) == NULL) {
         printf("Error opening rom file!\n");
@@ -50,14 +49,28 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    gb_readRom(&gb, rom);
+    // The ROM stays mapped after the file is closed
+    if(gb_readRom(&gb, rom) < 0) {
+        fclose(rom);
+        gb_destroy(&gb);
+        return 1;
+    }
     fclose(rom);
 
+    if(gb.cart.battery) {
+        gb_load_sav(&gb, "/tetris.sav");
+    }
+
+    if(!haveBootrom) {
+        gb_skip_bootrom(&gb);
+    }
+
     // crashes
     if(sdlctx_init(&sdlctx) < 0) {
         gb_destroy(&gb);
         return 0;
     }
+    sdlctx_attach(&sdlctx, &gb);
 
     while(appletMainLoop()) {
         consoleUpdate(NULL);
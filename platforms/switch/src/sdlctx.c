@@ -2,6 +2,8 @@
 #include "gb.h"
 #include "ppu.h"
 
+#include <string.h>
+
 static int gMainWindowW = 1920;
 static int gMainWindowH = 1080;
 
@@ -51,6 +53,9 @@ int sdlctx_init(struct sdlctx* ctx) {
         //SDL_RaiseWindow(ctx->windows[WINDOW_MAIN].win);
     }
 
+    ctx->tilesReady = (tilecache_init(&ctx->tiles) == 0);
+    ctx->bgMapShown = -1;
+
     //ctx->lastUpdateTicks = SDL_GetTicks64();
 
     return 0;
@@ -65,64 +70,82 @@ struct window_t* sdlctx_get_window_from_internal_id(struct sdlctx* ctx, u32 inte
     return NULL;
 }
 
-void sdlctx_renderMainWindow(struct sdlctx* ctx, u32* ppuFramebuffer) {
-    SDL_LockSurface(ctx->windows[WINDOW_MAIN].surface);
-    //memcpy(ctx->windows[WINDOW_MAIN].framebuffer, ppuFramebuffer, (gMainWindowW * gMainWindowH * sizeof(u32)));
-    for(int y = 0; y < 144; y++) {
-        for(int x = 0; x < 160; x++) {
-            ctx->windows[WINDOW_MAIN].framebuffer[(y * gMainWindowW) + x] = 0xFFFF00FF;// ppuFramebuffer[(y * 160) + x];
+// Has the PPU draw straight into the top left of the main window
+void sdlctx_attach(struct sdlctx* ctx, struct gb* gb) {
+    struct window_t* win = &ctx->windows[WINDOW_MAIN];
+    ppu_set_output(gb->ppu, win->framebuffer, win->surface->pitch, PPU_FORMAT_ARGB8888);
+    ppu_repaint_output(gb->ppu);
+}
+
+// The PPU draws straight into the window surface, so only the runs of
+// rows it changed need to go to the screen
+void sdlctx_renderMainWindow(struct sdlctx* ctx, struct gb* gb) {
+    u64 lines[PPU_LINE_WORDS];
+    if(!ppu_take_changed_lines(gb->ppu, lines)) {
+        return;
+    }
+    SDL_Rect rects[72];
+    int rectCount = 0;
+    int y = 0;
+    while(y < 144) {
+        if(!((lines[y >> 6] >> (y & 63)) & 1)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while(y < 144 && ((lines[y >> 6] >> (y & 63)) & 1)) {
+            y++;
         }
+        rects[rectCount++] = (SDL_Rect){ 0, first, 160, y - first };
     }
-    SDL_UnlockSurface(ctx->windows[WINDOW_MAIN].surface);
+    SDL_UpdateWindowSurfaceRects(ctx->windows[WINDOW_MAIN].win, rects, rectCount);
+}
 
-    SDL_UpdateWindowSurface(ctx->windows[WINDOW_MAIN].win);
+// Outlines the screen's 160x144 view of the BG map, wrapping around its
+// edges like the PPU does
+static void sdlctx_outlineViewport(u8* pixels, int pitch, u8 scx, u8 scy) {
+    for(int i = 0; i < 160; i++) {
+        u8 x = scx + i;
+        ((u32*) (pixels + scy * pitch))[x] = 0xFFFF0000;
+        ((u32*) (pixels + (u8) (scy + 143) * pitch))[x] = 0xFFFF0000;
+    }
+    for(int i = 0; i < 144; i++) {
+        u8 y = scy + i;
+        ((u32*) (pixels + y * pitch))[scx] = 0xFFFF0000;
+        ((u32*) (pixels + y * pitch))[(u8) (scx + 159)] = 0xFFFF0000;
+    }
 }
 
+// Shows the BG map to the right of the game in the main window. The tile
+// cache only redraws what changed, and the map is only copied out again
+// when it or the viewport moved
 void sdlctx_renderBGMapWindow(struct sdlctx* ctx, struct gb* gb) {
-    
-    SDL_LockSurface(ctx->windows[WINDOW_BGMAP].surface);
-
-    u16 bgMapStart = (gb->ppu->lcdc->bgMapArea == 0)? 0x9800 : 0x9C00;
-    u16 bgTilesStart = (gb->ppu->lcdc->bgTilesArea == 0)? 0x8800 : 0x8000;
+    if(!ctx->tilesReady) {
+        return;
+    }
+    tilecache_update(&ctx->tiles, gb);
 
+    int map = gb->ppu->lcdc->bgMapArea;
+    u8 scx = *gb->ppu->scx;
+    u8 scy = *gb->ppu->scy;
+    if(!ctx->tiles.mapsChanged[map] && map == ctx->bgMapShown && scx == ctx->bgMapScx && scy == ctx->bgMapScy) {
+        return;
+    }
+    ctx->tiles.mapsChanged[map] = false;
+    ctx->bgMapShown = map;
+    ctx->bgMapScx = scx;
+    ctx->bgMapScy = scy;
+
+    struct window_t* win = &ctx->windows[WINDOW_MAIN];
+    SDL_Rect rect = { 160 + gBGMapWindowBuffer * 2, 0, gBGMapWindowW, gBGMapWindowH };
+    u8* pixels = (u8*) win->surface->pixels + rect.x * sizeof(u32);
+    int pitch = win->surface->pitch;
     for(int y = 0; y < gBGMapWindowH; y++) {
-        for(int x = 0; x < gBGMapWindowW; x++) {
-            u8 scy = *gb->ppu->scy;
-            u8 scx = *gb->ppu->scx;
-            int bgMapX = x / 8;
-            int bgMapY = y / 8;
-            int xPixel = x % 8;
-            int yPixel = y % 8;
-            u16 bgMapOffset = (bgMapY * 32) + bgMapX;
-            u8 tileId = gb_read8(gb, bgMapStart + bgMapOffset);
-            u16 bgTilesOffset = tileId * 16;
-            u16 tileLineOffset = bgTilesStart + bgTilesOffset + (yPixel * 2);
-            u8 tileLineBytes[2] = { gb_read8(gb, tileLineOffset), gb_read8(gb, tileLineOffset + 1) };
-            u8 pixelBitMask = (1 << (7 - xPixel));
-            u8 colorHigh = (tileLineBytes[1] & pixelBitMask) >> (7 - xPixel);
-            u8 colorLow =  (tileLineBytes[0] & pixelBitMask) >> (7 - xPixel);
-            u8 internalColor = (colorHigh << 1) | colorLow;
-            u8 bgPalColor = (*gb->ppu->bgp >> (internalColor * 2)) & 0x3;
-            u32 finalColor = gColors[bgPalColor];
-
-            // 5 pixel border on all sides
-            int totalWidth = gBGMapWindowW + (gBGMapWindowBuffer * 2);
-            ctx->windows[WINDOW_BGMAP].framebuffer[((y + 5) * totalWidth) + x + 5] = finalColor;
-
-            // Draw the red viewport
-            bool yWrapsAround = ((int)(scy) + 144) > 256;
-            bool xWrapsAround = ((int)(scx) + 160) > 256;
-
-            if(( (y == scy || y == (u8)(scy + 144)) && ((x >= scx && x < scx + 160) || (xWrapsAround && x < (u8)(scx + 160))) ) ||
-               ( (x == scx || x == (u8)(scx + 160)) && ((y >= scy && y < scy + 144) || (yWrapsAround && y < (u8)(scy + 144))) )
-            ) {
-                ctx->windows[WINDOW_BGMAP].framebuffer[((y + 5) * 266) + x + 5] = 0xFFFF0000;
-            }
-        }
+        memcpy(pixels + y * pitch, ctx->tiles.maps[map] + y * TILECACHE_MAP_W, gBGMapWindowW * sizeof(u32));
     }
+    sdlctx_outlineViewport(pixels, pitch, scx, scy);
 
-    SDL_UnlockSurface(ctx->windows[WINDOW_BGMAP].surface);
-    SDL_UpdateWindowSurface(ctx->windows[WINDOW_BGMAP].win);
+    SDL_UpdateWindowSurfaceRects(win->win, &rect, 1);
 }
 
 void sdlctx_update(struct sdlctx* ctx, bool* stopped, bool completedFrame, struct gb* gb) {
@@ -140,13 +163,12 @@ void sdlctx_update(struct sdlctx* ctx, bool* stopped, bool completedFrame, struc
         }
     }
 
-    // Every 1/60th of a second, we copy the internal framebuffer from
-    // the PPU into the external framebuffer in the sdl context and refresh
+    // Every 1/60th of a second, we refresh the window the PPU draws into
     // TODO: There are probably 30 better ways to do this
     // u64 newUpdateTicks = SDL_GetTicks64();
     // if(newUpdateTicks - ctx->lastUpdateTicks >= (1000 / 60.0F)) {
     if(completedFrame) {
-        sdlctx_renderMainWindow(ctx, gb->ppu->framebuffer);
+        sdlctx_renderMainWindow(ctx, gb);
         // sdlctx_renderBGMapWindow(ctx, gb);
 
         // ctx->lastUpdateTicks = newUpdateTicks;
@@ -154,6 +176,9 @@ void sdlctx_update(struct sdlctx* ctx, bool* stopped, bool completedFrame, struc
 }
 
 void sdlctx_destroy(struct sdlctx* ctx) {
+    if(ctx->tilesReady) {
+        tilecache_destroy(&ctx->tiles);
+    }
     for(int i = 0; i < WINDOW_COUNT; i++) {
         SDL_DestroyWindow(ctx->windows[i].win);
     }
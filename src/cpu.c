@@ -1,11 +1,20 @@
 #include "cpu.h"
 #include "gb.h"
 #include "instructions.h"
+#include "profiler.h"
 
 
 void cpu_init(struct cpu* cpu, struct gb* gb) {
     cpu->gb = gb;
 
+    cpu->paused = false;
+    cpu->stopAtBootrom = false;
+    cpu->loggingEnabled = false;
+    cpu->stopped = false;
+    cpu->lastCycles = 0;
+    cpu->tracer = NULL;
+    cpu->profiler = NULL;
+
     cpu_reset(cpu);
 }
 
@@ -20,6 +29,12 @@ void cpu_reset(struct cpu* cpu) {
     cpu->imeWait = -1;
 
     cpu->linesPrinted = 0;
+    cpu->cycles = 0;
+#ifdef DIJON_OPCODE_STATS
+    opstats_reset(cpu);
+#endif
+
+    cpu_update_core(cpu);
 }
 
 void cpu_request_interrupt(struct cpu* cpu, u8 mask) {
@@ -70,26 +85,70 @@ bool cpu_service_interrupts(struct cpu* cpu) {
 
 void cpu_set_logging_enabled(struct cpu* cpu, bool e) {
     cpu->loggingEnabled = e;
+    cpu_update_core(cpu);
+}
+
+// Switches instruction logging to the binary tracer. Passing
+// NULL stops tracing
+void cpu_set_tracer(struct cpu* cpu, struct tracer* tracer) {
+    cpu->tracer = tracer;
+    cpu->loggingEnabled = (tracer != NULL);
+    cpu_update_core(cpu);
+}
+
+void cpu_set_profiler(struct cpu* cpu, struct profiler* profiler) {
+    cpu->profiler = profiler;
+    cpu_update_core(cpu);
 }
 
 void cpu_set_stop_at_bootrom(struct cpu* cpu, bool e) {
     cpu->stopAtBootrom = e;
+    cpu_update_core(cpu);
 }
 
-int cpu_run(struct cpu* cpu) {
-    if(cpu->paused || (cpu->stopAtBootrom && cpu->pc > 0xFF)) {
-        return 0;
+void cpu_set_paused(struct cpu* cpu, bool p) {
+    cpu->paused = p;
+    cpu_update_core(cpu);
+}
+
+FORCE_INLINE int cpu_run_core(struct cpu* cpu, const int flags) {
+    if(flags & CPU_CORE_DEBUG) {
+        if(cpu->paused || (cpu->stopAtBootrom && cpu->pc > 0xFF)) {
+            // Keep the rest of the system frozen too
+            cpu->lastCycles = 0;
+            return 0;
+        }
     }
 
     if(cpu->imeWait > 0) {
         cpu->imeWait--;
     }
 
-    int instrCycles = execute_instr(cpu);
+    u8 opcode = 0;
+    u16 oldSp = 0;
+    if(flags & CPU_CORE_PROFILE) {
+        opcode = gb_read8(cpu->gb, cpu->pc);
+        oldSp = cpu->sp;
+    }
+
+    int instrCycles;
+    switch(flags & (CPU_CORE_TRACE | CPU_CORE_BOOTROM)) {
+        case 0:                instrCycles = execute_instr(cpu);               break;
+        case CPU_CORE_TRACE:   instrCycles = execute_instr_trace(cpu);         break;
+        case CPU_CORE_BOOTROM: instrCycles = execute_instr_bootrom(cpu);       break;
+        default:               instrCycles = execute_instr_bootrom_trace(cpu); break;
+    }
     if(instrCycles == -1) {
         return -1;
     }
     cpu->lastCycles = instrCycles;
+#ifdef DIJON_OPCODE_STATS
+    cpu->opcodeStats[cpu->lastOpcode].count++;
+    cpu->opcodeStats[cpu->lastOpcode].cycles += instrCycles;
+#endif
+    if(flags & CPU_CORE_PROFILE) {
+        profiler_step(cpu->profiler, cpu, opcode, oldSp);
+    }
 
     // EI delays enabling ime by one instruction
     if(cpu->imeWait == 0) {
@@ -97,8 +156,44 @@ int cpu_run(struct cpu* cpu) {
         cpu->ime = true;
     }
     if(cpu->ime) {
-        cpu_service_interrupts(cpu);
+        if(cpu_service_interrupts(cpu) && (flags & CPU_CORE_PROFILE)) {
+            profiler_interrupt(cpu->profiler, cpu);
+        }
     }
+    cpu->cycles += cpu->lastCycles;
 
     return 0;
 }
+
+#define CPU_CORE(flags) \
+    static int cpu_run_core_##flags(struct cpu* cpu) { return cpu_run_core(cpu, flags); }
+CPU_CORE(0)  CPU_CORE(1)  CPU_CORE(2)  CPU_CORE(3)
+CPU_CORE(4)  CPU_CORE(5)  CPU_CORE(6)  CPU_CORE(7)
+CPU_CORE(8)  CPU_CORE(9)  CPU_CORE(10) CPU_CORE(11)
+CPU_CORE(12) CPU_CORE(13) CPU_CORE(14) CPU_CORE(15)
+
+static int (*const cpuCores[CPU_CORE_COUNT])(struct cpu*) = {
+    cpu_run_core_0,  cpu_run_core_1,  cpu_run_core_2,  cpu_run_core_3,
+    cpu_run_core_4,  cpu_run_core_5,  cpu_run_core_6,  cpu_run_core_7,
+    cpu_run_core_8,  cpu_run_core_9,  cpu_run_core_10, cpu_run_core_11,
+    cpu_run_core_12, cpu_run_core_13, cpu_run_core_14, cpu_run_core_15
+};
+
+// Picks the core matching the current debug flags. Must be called
+// whenever one of them changes
+void cpu_update_core(struct cpu* cpu) {
+    int flags = 0;
+    if(cpu->loggingEnabled)
+        flags |= CPU_CORE_TRACE;
+    if(cpu->gb->inBootrom)
+        flags |= CPU_CORE_BOOTROM;
+    if(cpu->paused || cpu->stopAtBootrom)
+        flags |= CPU_CORE_DEBUG;
+    if(cpu->profiler)
+        flags |= CPU_CORE_PROFILE;
+    cpu->core = cpuCores[flags];
+}
+
+int cpu_run(struct cpu* cpu) {
+    return cpu->core(cpu);
+}
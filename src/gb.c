@@ -7,6 +7,8 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "mbc.h"
+#include "hostprof.h"
+#include "romcache.h"
 
 
 void gb_init(struct gb* gb) {
@@ -15,16 +17,34 @@ void gb_init(struct gb* gb) {
     
     initMBCs();
 
+    gb->pool = NULL;
     gb_init_mmap(gb);
+    gb->bootrom = NULL;
     gb->cart.rom = NULL;
+    gb->cart.image = NULL;
+    gb->cart.ram = NULL;
+    gb->cart.romBankPtr = NULL;
+    gb->cart.ramBankPtr = NULL;
+    gb->cart.ramBacking = CART_RAM_NONE;
+    gb->cart.savPath = NULL;
+    gb->cart.sav = NULL;
+    gb->cart.hasRtc = false;
+    gb->cart.ramDirtyStart = gb->cart.ramDirtyEnd = 0;
+
+    gb->keysPressed = 0xFF;
+    gb->inBootrom = true;
+    gb->frameProbeStart = 0;
+    memset(&gb->perf, 0, sizeof(gb->perf));
+    gb_dirty_mark_all(gb);
+    memset(gb->pageHashes, 0, sizeof(gb->pageHashes));
+    gb->memHash = 0;
+    gb->cartRamHash = 0;
 
     gb->cpu = (struct cpu*) malloc(sizeof(struct cpu));
     cpu_init(gb->cpu, gb);
+    gb->cart.cycles = &gb->cpu->cycles;
     gb->ppu = (struct ppu*) malloc(sizeof(struct ppu));
     ppu_init(gb->ppu, gb);
-
-    gb->keysPressed = 0xFF;
-    gb->inBootrom = true;
 }
 
 int gb_run(struct gb* gb, bool* stopped, bool* frameCompleted) {
@@ -42,23 +62,176 @@ int gb_run(struct gb* gb, bool* stopped, bool* frameCompleted) {
     if(cpu_run(gb->cpu) < 0) {
         return -1;
     }
+    // A paused or stopped CPU runs no cycles and no instruction
+    if(gb->cpu->lastCycles != 0) {
+        gb->perf.instructions++;
+    }
     *frameCompleted = ppu_run(gb->ppu, gb->cpu->lastCycles);
+    if(*frameCompleted) {
+        hostprof_end(HOSTPROF_FRAME, gb->frameProbeStart);
+        gb->frameProbeStart = hostprof_begin();
+
+        u64 now = hostprof_now();
+        if(gb->perf.frameStart != 0) {
+            gb->perf.lastFrameNs = now - gb->perf.frameStart;
+        }
+        gb->perf.frameStart = now;
+        gb->perf.frames++;
+
+        cart_ram_frame(&gb->cart);
+    }
 
     *stopped = gb->cpu->stopped;
 
     return 0;
 }
 
+// Everything a cloned instance owns, allocated in one piece
+struct gb_pool_slot {
+    struct gb gb;
+    struct cpu cpu;
+    struct ppu ppu;
+    u8 mmap[0x10000];
+    u8 bootrom[0x100];
+    u8* cartRam; // Grown on demand and kept with the slot
+    u32 cartRamSize;
+
+    struct gb_pool_slot* nextFree;
+};
+
+struct gb_pool_chunk {
+    struct gb_pool_chunk* next;
+    struct gb_pool_slot slots[];
+};
+
 void gb_destroy(struct gb* gb) {
     ppu_destroy(gb->ppu);
-    free(gb->ppu);
     cpu_destroy(gb->cpu);
+    romcache_release(gb->cart.image);
+    cart_ram_destroy(&gb->cart);
+
+    if(gb->pool != NULL) {
+        // gb is the first member of its slot
+        struct gb_pool_slot* slot = (struct gb_pool_slot*) gb;
+        slot->nextFree = gb->pool->freeSlots;
+        gb->pool->freeSlots = slot;
+        return;
+    }
+    free(gb->ppu);
     free(gb->cpu);
     free(gb->mmap);
-    free(gb->cart.rom);
     free(gb->bootrom);
 }
 
+void gb_pool_init(struct gb_pool* pool, int slotsPerChunk) {
+    pool->slotsPerChunk = (slotsPerChunk > 0)? slotsPerChunk : 1;
+    pool->chunks = NULL;
+    pool->freeSlots = NULL;
+}
+
+// All clones from this pool must have been destroyed first
+void gb_pool_destroy(struct gb_pool* pool) {
+    while(pool->chunks != NULL) {
+        struct gb_pool_chunk* next = pool->chunks->next;
+        for(int i = 0; i < pool->slotsPerChunk; i++) {
+            free(pool->chunks->slots[i].cartRam);
+        }
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    pool->freeSlots = NULL;
+}
+
+static struct gb_pool_slot* gb_pool_get(struct gb_pool* pool) {
+    if(pool->freeSlots == NULL) {
+        struct gb_pool_chunk* chunk = (struct gb_pool_chunk*) malloc(sizeof(struct gb_pool_chunk) +
+            pool->slotsPerChunk * sizeof(struct gb_pool_slot));
+        if(chunk == NULL) {
+            printf("Error: Could not grow instance pool!\n");
+            return NULL;
+        }
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        for(int i = pool->slotsPerChunk - 1; i >= 0; i--) {
+            chunk->slots[i].cartRam = NULL;
+            chunk->slots[i].cartRamSize = 0;
+            chunk->slots[i].nextFree = pool->freeSlots;
+            pool->freeSlots = &chunk->slots[i];
+        }
+    }
+
+    struct gb_pool_slot* slot = pool->freeSlots;
+    pool->freeSlots = slot->nextFree;
+    return slot;
+}
+
+// Creates an independent copy of src that shares its ROM image.
+// Destroy it with gb_destroy, which hands the memory back to the pool
+struct gb* gb_clone(struct gb_pool* pool, const struct gb* src) {
+    struct gb_pool_slot* slot = gb_pool_get(pool);
+    if(slot == NULL) {
+        return NULL;
+    }
+
+    if(src->cart.ram != NULL && slot->cartRamSize < src->cart.ramBytes) {
+        u8* ram = (u8*) realloc(slot->cartRam, src->cart.ramBytes);
+        if(ram == NULL) {
+            printf("Error: Could not allocate cartridge RAM for a clone!\n");
+            slot->nextFree = pool->freeSlots;
+            pool->freeSlots = slot;
+            return NULL;
+        }
+        slot->cartRam = ram;
+        slot->cartRamSize = src->cart.ramBytes;
+    }
+
+    struct gb* gb = &slot->gb;
+    *gb = *src;
+    gb->pool = pool;
+    gb->cpu = &slot->cpu;
+    gb->ppu = &slot->ppu;
+    gb->mmap = slot->mmap;
+    gb->frameProbeStart = 0;
+    memcpy(slot->mmap, src->mmap, sizeof(slot->mmap));
+    if(src->bootrom != NULL) {
+        memcpy(slot->bootrom, src->bootrom, sizeof(slot->bootrom));
+        gb->bootrom = slot->bootrom;
+    }
+    if(src->cart.image != NULL) {
+        romcache_retain(src->cart.image);
+    }
+    // Clones get their own cart RAM and never write to the parent's .sav
+    if(src->cart.ram != NULL) {
+        memcpy(slot->cartRam, src->cart.ram, src->cart.ramBytes);
+        gb->cart.ram = slot->cartRam;
+        gb->cart.ramBacking = CART_RAM_BORROWED;
+        cart_map_ram_bank(&gb->cart, gb->cart.ramBank);
+    }
+    gb->cart.battery = false;
+    gb->cart.savPath = NULL;
+    gb->cart.sav = NULL;
+    gb->cart.cycles = &slot->cpu.cycles;
+    gb->cart.ramDirtyStart = gb->cart.ramDirtyEnd = 0;
+
+    slot->cpu = *src->cpu;
+    slot->cpu.gb = gb;
+    // Clones never write into their parent's trace or profile
+    slot->cpu.tracer = NULL;
+    slot->cpu.profiler = NULL;
+    slot->cpu.loggingEnabled = false;
+    cpu_update_core(&slot->cpu);
+
+    slot->ppu = *src->ppu;
+    ppu_bind(&slot->ppu, gb);
+    // Clones draw into their own framebuffer, not the parent's surface
+    if(src->ppu->outExternal) {
+        ppu_set_output(&slot->ppu, NULL, 0, PPU_FORMAT_ARGB8888);
+        ppu_repaint_output(&slot->ppu);
+    }
+
+    return gb;
+}
+
 void gb_init_mmap(struct gb* gb) {
 
     gb->mmap = (u8*) malloc(1024 * 64); // 64 KB of memory total
@@ -72,56 +245,234 @@ void gb_readBootrom(struct gb* gb, FILE* bootrom) {
     fread(gb->bootrom, 1, 0x100, bootrom);
 }
 
-void gb_readRom(struct gb* gb, FILE* rom) {
-    fseek(rom, 0L, SEEK_END);
-    long size = ftell(rom);
-    rewind(rom);
-
-    gb->cart.rom = (u8*) malloc(size);
-    fread(gb->cart.rom, 1, size, rom);
-
-    rewind(rom);
-
-    int bytes_to_copy = (size < 0x8000)? size : 0x8000;
-    fread(gb->mmap, 1, bytes_to_copy, rom);
+int gb_readRom(struct gb* gb, FILE* rom) {
+    // ROM reads always go through the MBC, so nothing is copied into mmap
+    struct rom_image* image = romcache_acquire(rom);
+    if(image == NULL) {
+        return -1;
+    }
+    romcache_release(gb->cart.image);
+    gb->cart.image = image;
+    gb->cart.rom = image->data;
 
     // Read cartridge header
     gb->cart.mbcCode = gb->cart.rom[0x147];
-    printf("ROM size: %ld, MBC: %02X\n", size, gb->cart.mbcCode);
+    printf("ROM size: %zu, MBC: %02X\n", image->size, gb->cart.mbcCode);
     switch(gb->cart.mbcCode) {
         case 0x00: // No MBC
+        case 0x08: // ROM + RAM
+        case 0x09: // ROM + RAM + BATTERY
             gb->cart.mbc = &mbcs[0];
             break;
         case 0x01: // MBC1
+        case 0x02: // MBC1 + RAM
+        case 0x03: // MBC1 + RAM + BATTERY
             gb->cart.mbc = &mbcs[1];
             break;
-        case 0x03: // MBC3
+        case 0x0F: // MBC3 + TIMER + BATTERY
         case 0x10: // MBC3 + RAM + BATTERY + TIMER
+        case 0x11: // MBC3
+        case 0x12: // MBC3 + RAM
         case 0x13: // MBC3 + RAM + BATTERY
-        case 0x1B: // MBC5 + RAM + BATTERY
             gb->cart.mbc = &mbcs[3];
             break;
+        case 0x19: // MBC5
+        case 0x1A: // MBC5 + RAM
+        case 0x1B: // MBC5 + RAM + BATTERY
+        case 0x1C: // MBC5 + RUMBLE
+        case 0x1D: // MBC5 + RUMBLE + RAM
+        case 0x1E: // MBC5 + RUMBLE + RAM + BATTERY
+            gb->cart.mbc = &mbcs[5];
+            break;
         default:
             printf("Warning: Unsupported MBC %02X. Using MBC 1!\n", gb->cart.mbcCode);
             gb->cart.mbc = &mbcs[1];
     }
+    switch(gb->cart.mbcCode) {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F: case 0x10:
+        case 0x13: case 0x1B: case 0x1E: case 0x22: case 0xFF:
+            gb->cart.battery = true;
+            break;
+        default:
+            gb->cart.battery = false;
+    }
 
     // ROM size in KB is 32 * (1 << n),
     // where n is rom[0x148]
     gb->cart.romSize = gb->cart.rom[0x148];
     gb->cart.ramSize = gb->cart.rom[0x149];
+    // Trust the file over the header, short images are padded to 2 banks
+    gb->cart.romBanks = image->size / 0x4000;
+    if(gb->cart.romBanks < 2)
+        gb->cart.romBanks = 2;
+    // All mapper registers default to 00, except MBC5's ROM bank
+    memset(gb->cart.regs, 0x00, sizeof(gb->cart.regs));
+    if(gb->cart.mbc == &mbcs[5])
+        gb->cart.regs[MBC5_ROMBANKLO] = 1;
+    cart_map_rom_bank(&gb->cart, 1);
+
+    cart_ram_destroy(&gb->cart);
+    gb->cart.hasRtc = (gb->cart.mbcCode == 0x0F || gb->cart.mbcCode == 0x10);
+    if(cart_ram_init(&gb->cart) < 0) {
+        return -1;
+    }
+    // Without a mapper, RAM is always there
+    gb->cart.ramEnabled = (gb->cart.mbc == &mbcs[0]);
+
+    return 0;
+}
+
+// Keeps battery-backed RAM in path, see cart_ram_open_sav()
+int gb_load_sav(struct gb* gb, const char* path) {
+    return cart_ram_open_sav(&gb->cart, path);
+}
+
+// I/O registers as the DMG bootrom leaves them
+static const struct { u16 addr; u8 value; } gPostBootIO[] = {
+    { 0xFF00, 0xCF }, { 0xFF05, 0x00 }, { 0xFF06, 0x00 }, { 0xFF07, 0xF8 },
+    { 0xFF0F, 0xE1 }, { 0xFF10, 0x80 }, { 0xFF11, 0xBF }, { 0xFF12, 0xF3 },
+    { 0xFF14, 0xBF }, { 0xFF16, 0x3F }, { 0xFF17, 0x00 }, { 0xFF19, 0xBF },
+    { 0xFF1A, 0x7F }, { 0xFF1B, 0xFF }, { 0xFF1C, 0x9F }, { 0xFF1E, 0xBF },
+    { 0xFF20, 0xFF }, { 0xFF21, 0x00 }, { 0xFF22, 0x00 }, { 0xFF23, 0xBF },
+    { 0xFF24, 0x77 }, { 0xFF25, 0xF3 }, { 0xFF26, 0xF1 }, { 0xFF40, 0x91 },
+    { 0xFF42, 0x00 }, { 0xFF43, 0x00 }, { 0xFF44, 0x00 }, { 0xFF45, 0x00 },
+    { 0xFF47, 0xFC }, { 0xFF48, 0xFF }, { 0xFF49, 0xFF }, { 0xFF4A, 0x00 },
+    { 0xFF4B, 0x00 }, { 0xFF50, 0x01 }, { 0xFFFF, 0x00 }
+};
+
+// The (R) tile the bootrom draws after the logo
+static const u8 gLogoTrademark[8] = { 0x3C, 0x42, 0xB9, 0xA5, 0xB9, 0xA5, 0x42, 0x3C };
+
+// Each logo nibble becomes one row of pixels doubled in width
+static u8 gb_logo_row(u8 nibble) {
+    u8 row = 0;
+    for(int i = 3; i >= 0; i--) {
+        u8 bit = (nibble >> i) & 1;
+        row = (row << 2) | (bit << 1) | bit;
+    }
+    return row;
+}
+
+// Draws the logo from the cartridge header into VRAM like the bootrom
+static void gb_draw_logo(struct gb* gb) {
+    memset(gb->mmap + 0x8000, 0x00, 0x2000);
+
+    // Tiles 1-24 from the header, every row drawn twice
+    u8* tiles = gb->mmap + 0x8010;
+    for(int i = 0; i < 0x30; i++) {
+        u8 logo = gb->cart.rom[0x104 + i];
+        u8 hi = gb_logo_row(logo >> 4);
+        u8 lo = gb_logo_row(logo & 0xF);
+        tiles[0] = hi;
+        tiles[2] = hi;
+        tiles[4] = lo;
+        tiles[6] = lo;
+        tiles += 8;
+    }
+    // Tile 25 is the (R)
+    for(int i = 0; i < 8; i++) {
+        gb->mmap[0x8190 + i * 2] = gLogoTrademark[i];
+    }
+
+    // Two rows of 12 tiles in the middle of the map
+    gb->mmap[0x9910] = 0x19;
+    for(int i = 0; i < 12; i++) {
+        gb->mmap[0x9904 + i] = i + 1;
+        gb->mmap[0x9924 + i] = i + 13;
+    }
+}
+
+// Boots straight into the cartridge, without a bootrom, in the state the
+// DMG bootrom leaves behind. The ROM must be loaded first
+void gb_skip_bootrom(struct gb* gb) {
+    struct cpu* cpu = gb->cpu;
+    cpu_reset(cpu);
+    cpu->af = 0x01B0;
+    cpu->bc = 0x0013;
+    cpu->de = 0x00D8;
+    cpu->hl = 0x014D;
+    cpu->sp = 0xFFFE;
+    cpu->pc = 0x0100;
+
+    gb_draw_logo(gb);
+    memset(gb->mmap + 0xFE00, 0x00, 0xA0);
+    for(size_t i = 0; i < sizeof(gPostBootIO) / sizeof(gPostBootIO[0]); i++) {
+        gb->mmap[gPostBootIO[i].addr] = gPostBootIO[i].value;
+    }
+
+    // The bootrom finishes in vblank; start cleanly at the top of the
+    // next frame instead, which is as far as this PPU models timing
+    struct ppu* ppu = gb->ppu;
+    ppu->stat->mode = 0x02;
+    ppu->stat->lycMatch = 1;
+    ppu->cyclesThisMode = 0;
+    ppu->vblankCycles = 0;
+    ppu->objsThisScanline = 0;
+    ppu->objIndexDirty = true;
+    ppu->hblankCycles = 51;
+    ppu->winLine = 0;
+    ppu->winTriggered = false;
+
+    gb->dmaScheduled = false;
+    gb->inDMA = false;
+    gb_dirty_mark_all(gb);
+
+    // Same path as the bootrom writing to 0xFF50
+    gb_disable_bootrom(gb);
 }
 
 void gb_disable_bootrom(struct gb* gb) {
     printf("Disabling bootrom!\n");
     gb->inBootrom = false;
+    cpu_update_core(gb->cpu);
+}
+
+// The PPU updates LY and STAT through pointers rather than gb_write8,
+// so the I/O page is always reported dirty
+void gb_dirty_clear(struct gb* gb) {
+    memset(gb->dirtyPages, 0, sizeof(gb->dirtyPages));
+    gb->dirtyPages[3] = 1ULL << 63;
+}
+
+void gb_dirty_mark_all(struct gb* gb) {
+    memset(gb->dirtyPages, 0xFF, sizeof(gb->dirtyPages));
+    memset(gb->hashPending, 0xFF, sizeof(gb->hashPending));
+}
+
+// Host memory holding the 0xA0 bytes at src, or NULL if they have to be
+// read through the bus. Sources are 0x100 aligned, so never span banks
+static const u8* gb_dma_source(struct gb* gb, u16 src) {
+    if(src < 0x8000) {
+        if(src < 0x100 && gb->inBootrom)
+            return gb->bootrom + src;
+        if(src < 0x4000)
+            return gb->cart.rom + src;
+        return gb->cart.romBankPtr + (src - 0x4000);
+    }
+    if((src & 0xE000) == 0xA000) {
+        struct cart_t* cart = &gb->cart;
+        if(!cart->ramEnabled || cart->rtc.select || cart->ramBankPtr == NULL)
+            return NULL;
+        return cart->ramBankPtr + (src & cart->ramMask);
+    }
+    // VRAM and WRAM. Anything higher isn't a valid source anyway
+    if(src < 0xE000)
+        return gb->mmap + src;
+    return NULL;
 }
 
 void gb_dma(struct gb* gb) {
-    for(u16 i = 0; i < 0xA0; i++) {
-        gb_write8(gb, 0xFE00 + i, gb_read8(gb, gb->dmaAddress + i));
+    HOSTPROF_SCOPE(HOSTPROF_OAM_DMA);
+    const u8* src = gb_dma_source(gb, gb->dmaAddress);
+    if(src != NULL) {
+        memcpy(gb->mmap + 0xFE00, src, 0xA0);
+    } else {
+        for(u16 i = 0; i < 0xA0; i++) {
+            gb->mmap[0xFE00 + i] = gb_read8(gb, gb->dmaAddress + i);
+        }
     }
-    //printf("DMA'ing!\n");
+    gb_mark_dirty(gb, 0xFE00);
+    gb->ppu->objIndexDirty = true;
 }
 
 void gb_keypress(struct gb* gb, enum key_e key) {
@@ -142,6 +493,64 @@ void gb_schedule_dma(struct gb* gb, u8 highByte) {
     }
 }
 
+/*****************
+ ** I/O handlers **
+*****************/
+// P1, the selected half of the joypad
+static u8 io_read_joypad(struct gb* gb, u16 addr) {
+    u8 selections = gb->mmap[addr] & 0x30;
+    // TODO: Fix this, it treats DPAD buttons as action buttons
+    if(selections == 0x30)
+        return 0xF;
+    else if(selections == 0x20) {
+        return gb->keysPressed & 0xF;
+    }
+    else {
+        return gb->keysPressed >> 4;
+    }
+}
+
+static void io_write_dma(struct gb* gb, u16 addr, u8 byte) {
+    gb->mmap[addr] = byte;
+    gb_schedule_dma(gb, byte);
+}
+
+// The object index depends on the object height
+static void io_write_lcdc(struct gb* gb, u16 addr, u8 byte) {
+    if((gb->mmap[addr] ^ byte) & 0x04) {
+        gb->ppu->objIndexDirty = true;
+    }
+    gb->mmap[addr] = byte;
+}
+
+static void io_write_bootrom(struct gb* gb, u16 addr, u8 byte) {
+    gb->mmap[addr] = byte;
+    if(byte == 0x1) {
+        gb_disable_bootrom(gb);
+    }
+}
+
+// Filled in at compile time, so creating an instance never touches it
+// and hooks added with gb_io_register() stay
+static struct gb_io_handler gIOHandlers[GB_IO_COUNT] = {
+    [0x00] = { &io_read_joypad, NULL },
+    [0x40] = { NULL, &io_write_lcdc },
+    [0x46] = { NULL, &io_write_dma },
+    [0x50] = { NULL, &io_write_bootrom },
+};
+
+// Hooks a peripheral into an I/O register, for every instance. Not
+// synchronised with running instances, so call it before starting them
+void gb_io_register(u16 addr, u8 (*read)(struct gb*, u16), void (*write)(struct gb*, u16, u8)) {
+    int io = gb_io_index(addr);
+    if(addr < 0xFF00 || io < 0) {
+        printf("Error: %#06x is not an I/O register!\n", addr);
+        return;
+    }
+    gIOHandlers[io].read = read;
+    gIOHandlers[io].write = write;
+}
+
 // TODO: Remove this
 u8* gb_get_mmap_ptr(struct gb* gb, u16 addr) {
     return gb->mmap + addr;
@@ -151,23 +560,21 @@ u8 gb_read8(struct gb* gb, u16 addr) {
     if(addr < 0x100 && gb->inBootrom) {
         return gb->bootrom[addr];
     }
-    else if(addr < 0x8000) {
+    return gb_read8_postboot(gb, addr);
+}
+
+// Same as gb_read8, but assumes the bootrom is no longer mapped
+u8 gb_read8_postboot(struct gb* gb, u16 addr) {
+    if(addr < 0x8000) {
         return gb->cart.mbc->read8(&gb->cart, addr);
     }
-    
-    if(addr == 0xFF00) {
-        u8 p1 = gb->mmap[addr];
-        u8 selections = p1 & 0x30;
-        // TODO: There must be a better way to do this
-        // Oh yeah, and also fix it because it treats
-        // DPAD buttons as action buttons
-        if(selections == 0x30)
-            return 0xF;
-        else if(selections == 0x20) {
-            return gb->keysPressed & 0xF;
-        }
-        else {
-            return gb->keysPressed >> 4;
+    if((addr & 0xE000) == 0xA000) {
+        return cart_ram_read8(&gb->cart, addr);
+    }
+    if(addr >= 0xFF00) {
+        int io = gb_io_index(addr);
+        if(io >= 0 && gIOHandlers[io].read != NULL) {
+            return gIOHandlers[io].read(gb, addr);
         }
     }
     return gb->mmap[addr];
@@ -177,24 +584,41 @@ void gb_write8(struct gb* gb, u16 addr, u8 byte) {
     if(addr < 0x8000) {
         return gb->cart.mbc->write8(&gb->cart, addr, byte);
     }
-
-    gb->mmap[addr] = byte;
-
-    if(addr == 0xFF46) {
-        gb_schedule_dma(gb, byte);
+    if((addr & 0xE000) == 0xA000) {
+        return cart_ram_write8(&gb->cart, addr, byte);
     }
-    if(addr == 0xFF50 && byte == 0x1) {
-        gb_disable_bootrom(gb);
+    if(addr >= 0xFE00) {
+        if(addr >= 0xFF00) {
+            int io = gb_io_index(addr);
+            if(io >= 0 && gIOHandlers[io].write != NULL) {
+                // The I/O page is always dirty, see gb_dirty_clear()
+                return gIOHandlers[io].write(gb, addr, byte);
+            }
+        } else if(addr < 0xFEA0) {
+            gb->ppu->objIndexDirty = true;
+        }
     }
+
+    gb->mmap[addr] = byte;
+    gb_mark_dirty(gb, addr);
 }
 
 u16 gb_read16(struct gb* gb, u16 addr) {
     if(addr < 0x100 && gb->inBootrom) {
         return (gb->bootrom[addr + 1] << 8) | gb->bootrom[addr];
     }
-    else if(addr < 0x8000) {
+    return gb_read16_postboot(gb, addr);
+}
+
+// Same as gb_read16, but assumes the bootrom is no longer mapped
+u16 gb_read16_postboot(struct gb* gb, u16 addr) {
+    if(addr < 0x7FFF) {
         return gb->cart.mbc->read16(&gb->cart, addr);
     }
+    // Either byte in cart RAM or I/O, or straddling ROM and VRAM
+    if((addr & 0xE000) == 0xA000 || addr == 0x9FFF || addr == 0x7FFF || addr >= 0xFEFF) {
+        return gb_read8_postboot(gb, addr) | (gb_read8_postboot(gb, addr + 1) << 8);
+    }
 
     return (gb->mmap[addr + 1] << 8) | gb->mmap[addr];
 }
@@ -203,6 +627,14 @@ void gb_write16(struct gb* gb, u16 addr, u16 word) {
     if(addr < 0x8000) {
         return gb->cart.mbc->write16(&gb->cart, addr, word);
     }
+    // Either byte in cart RAM, OAM or I/O
+    if((addr & 0xE000) == 0xA000 || addr == 0x9FFF || addr >= 0xFDFF) {
+        gb_write8(gb, addr, word & 0xFF);
+        gb_write8(gb, addr + 1, word >> 8);
+        return;
+    }
     gb->mmap[addr] = word & 0xFF;
     gb->mmap[addr + 1] = word >> 8;
+    gb_mark_dirty(gb, addr);
+    gb_mark_dirty(gb, addr + 1);
 }
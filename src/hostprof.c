@@ -0,0 +1,151 @@
+#include "hostprof.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+struct hostprof_event {
+    u64 start; // ns since the capture epoch
+    u32 dur;   // ns
+    u32 phase;
+};
+
+struct hostprof_buffer {
+    struct hostprof_buffer* next;
+    u32 tid;
+    atomic_uint count;
+    struct hostprof_event events[HOSTPROF_BUFFER_SIZE];
+};
+
+static const char* gPhaseNames[HOSTPROF_PHASE_COUNT] = {
+    "frame",
+    "ppu_scanline",
+    "oam_dma",
+    "texture_upload",
+    "imgui",
+    "present"
+};
+
+atomic_bool gHostprofCapturing = false;
+
+static pthread_mutex_t gBuffersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct hostprof_buffer* gBuffers = NULL;
+static u32 gNextTid = 1;
+// Bumped when the buffers are freed, so threads drop their stale pointer
+static atomic_uint gGeneration = 0;
+static _Thread_local struct hostprof_buffer* tBuffer = NULL;
+static _Thread_local u32 tGeneration = 0;
+
+
+u64 hostprof_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    // +1 so a valid timestamp is never 0
+    return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+// Each thread gets its own buffer on first use, so recording never locks
+static struct hostprof_buffer* hostprof_thread_buffer() {
+    u32 generation = atomic_load_explicit(&gGeneration, memory_order_acquire);
+    if(tBuffer == NULL || tGeneration != generation) {
+        tBuffer = NULL;
+        struct hostprof_buffer* b = (struct hostprof_buffer*) calloc(1, sizeof(struct hostprof_buffer));
+        if(b == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&gBuffersLock);
+        b->tid = gNextTid++;
+        b->next = gBuffers;
+        gBuffers = b;
+        pthread_mutex_unlock(&gBuffersLock);
+        tBuffer = b;
+        tGeneration = generation;
+    }
+    return tBuffer;
+}
+
+void hostprof_record(enum hostprof_phase phase, u64 start) {
+    struct hostprof_buffer* b = hostprof_thread_buffer();
+    if(b == NULL) {
+        return;
+    }
+    u64 end = hostprof_now();
+    u32 i = atomic_load_explicit(&b->count, memory_order_relaxed);
+    struct hostprof_event* e = &b->events[i & (HOSTPROF_BUFFER_SIZE - 1)];
+    e->start = start;
+    e->dur = (u32)(end - start);
+    e->phase = phase;
+    atomic_store_explicit(&b->count, i + 1, memory_order_release);
+}
+
+void hostprof_start() {
+    // Forget anything from a previous capture
+    pthread_mutex_lock(&gBuffersLock);
+    for(struct hostprof_buffer* b = gBuffers; b != NULL; b = b->next) {
+        atomic_store(&b->count, 0);
+    }
+    pthread_mutex_unlock(&gBuffersLock);
+
+    atomic_store(&gHostprofCapturing, true);
+}
+
+void hostprof_stop() {
+    atomic_store(&gHostprofCapturing, false);
+}
+
+int hostprof_write_json(const char* path) {
+    FILE* f;
+    if((f = fopen(path, "w")) == NULL) {
+        printf("Error opening host profile %s!\n", path);
+        return -1;
+    }
+
+    // Timestamps are relative to the earliest event, in microseconds
+    pthread_mutex_lock(&gBuffersLock);
+    u64 epoch = UINT64_MAX;
+    for(struct hostprof_buffer* b = gBuffers; b != NULL; b = b->next) {
+        u32 count = atomic_load_explicit(&b->count, memory_order_acquire);
+        u32 first = (count > HOSTPROF_BUFFER_SIZE)? count - HOSTPROF_BUFFER_SIZE : 0;
+        if(count > first && b->events[first & (HOSTPROF_BUFFER_SIZE - 1)].start < epoch)
+            epoch = b->events[first & (HOSTPROF_BUFFER_SIZE - 1)].start;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool firstEvent = true;
+    for(struct hostprof_buffer* b = gBuffers; b != NULL; b = b->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                firstEvent? "" : ",\n", b->tid, b->tid);
+        firstEvent = false;
+
+        u32 count = atomic_load_explicit(&b->count, memory_order_acquire);
+        u32 first = (count > HOSTPROF_BUFFER_SIZE)? count - HOSTPROF_BUFFER_SIZE : 0;
+        for(u32 i = first; i < count; i++) {
+            const struct hostprof_event* e = &b->events[i & (HOSTPROF_BUFFER_SIZE - 1)];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    gPhaseNames[e->phase], b->tid, (e->start - epoch) / 1000.0, e->dur / 1000.0);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&gBuffersLock);
+
+    fclose(f);
+    printf("Wrote host profile to %s\n", path);
+    return 0;
+}
+
+void hostprof_destroy() {
+    hostprof_stop();
+    pthread_mutex_lock(&gBuffersLock);
+    struct hostprof_buffer* b = gBuffers;
+    while(b != NULL) {
+        struct hostprof_buffer* next = b->next;
+        free(b);
+        b = next;
+    }
+    gBuffers = NULL;
+    atomic_fetch_add_explicit(&gGeneration, 1, memory_order_release);
+    pthread_mutex_unlock(&gBuffersLock);
+    tBuffer = NULL;
+}
@@ -2,9 +2,15 @@
 #include "cpu.h"
 #include "gb.h"
 #include "util.h"
+#include "trace.h"
 
-#define READ8(addr)  gb_read8(cpu->gb, addr)
-#define READ16(addr) gb_read16(cpu->gb, addr)
+// `flags` is a compile-time constant in every specialised core,
+// so these checks fold away entirely
+#define TRACING (flags & CPU_CORE_TRACE)
+#define BOOTROM (flags & CPU_CORE_BOOTROM)
+
+#define READ8(addr)  (BOOTROM? gb_read8(cpu->gb, addr) : gb_read8_postboot(cpu->gb, addr))
+#define READ16(addr) (BOOTROM? gb_read16(cpu->gb, addr) : gb_read16_postboot(cpu->gb, addr))
 #define WRITE8(addr, data) gb_write8(cpu->gb, addr, data)
 #define WRITE16(addr, data) gb_write16(cpu->gb, addr, data)
 
@@ -596,9 +602,16 @@ struct instr_t instructions[512] = {
 #define DI() \
     cpu->ime = false; \
     return 4;
+#ifdef DIJON_OPCODE_STATS
+#define COUNT_OPCODE(index) cpu->lastOpcode = (index);
+#else
+#define COUNT_OPCODE(index)
+#endif
+
 #define CB() \
     u8 nextop = READ8(PC++); \
-    return execute_CB(cpu, nextop);
+    COUNT_OPCODE(256 + nextop) \
+    return execute_CB(cpu, nextop, flags);
 
 // Incs
 #define INC(reg) \
@@ -1414,18 +1427,26 @@ struct instr_t instructions[512] = {
 
 
 
-int execute_instr(struct cpu* cpu) {
+FORCE_INLINE int execute_CB(struct cpu* cpu, u8 opcode, const int flags);
+
+FORCE_INLINE int execute_instr_core(struct cpu* cpu, const int flags) {
 
     u8 opcode = READ8(cpu->pc);
 
-    if(cpu->loggingEnabled) {
-        log_instruction_line(cpu, PC, opcode);
-        if(opcode == 0xCB) {
-            log_instruction_line(cpu, PC + 1, READ8(cpu->pc + 1) + 256);
+    if(TRACING) {
+        if(cpu->tracer) {
+            trace_push(cpu->tracer, cpu);
+        }
+        else {
+            log_instruction_line(cpu, PC, opcode);
+            if(opcode == 0xCB) {
+                log_instruction_line(cpu, PC + 1, READ8(cpu->pc + 1) + 256);
+            }
         }
     }
 
     cpu->pc++;
+    COUNT_OPCODE(opcode)
 
     switch(opcode) {
         case 0x00: { NOP();            } case 0x01: { LD_R16_U16(BC);      } case 0x02: { LD_XR16_R(BC, A); } case 0x03: { INC_R16(BC);      } case 0x04: { INC(B);           } case 0x05: { DEC(B);           } case 0x06: { LD_R_U8(B);       } case 0x07: { RLCA();           }
@@ -1465,7 +1486,7 @@ int execute_instr(struct cpu* cpu) {
     return -1;
 }
 
-int execute_CB(struct cpu* cpu, u8 opcode) {
+FORCE_INLINE int execute_CB(struct cpu* cpu, u8 opcode, const int flags) {
 
     switch(opcode) {
         case 0x00: { RLC(B);    } case 0x01: { RLC(C);    } case 0x02: { RLC(D);    } case 0x03: { RLC(E);    } case 0x04: { RLC(H);    } case 0x05: { RLC(L);    } case 0x06: { RLC_HL();  } case 0x07: { RLC(A);    }
@@ -1504,3 +1525,19 @@ int execute_CB(struct cpu* cpu, u8 opcode) {
 
     return -1;
 }
+
+int execute_instr(struct cpu* cpu) {
+    return execute_instr_core(cpu, 0);
+}
+
+int execute_instr_trace(struct cpu* cpu) {
+    return execute_instr_core(cpu, CPU_CORE_TRACE);
+}
+
+int execute_instr_bootrom(struct cpu* cpu) {
+    return execute_instr_core(cpu, CPU_CORE_BOOTROM);
+}
+
+int execute_instr_bootrom_trace(struct cpu* cpu) {
+    return execute_instr_core(cpu, CPU_CORE_BOOTROM | CPU_CORE_TRACE);
+}
@@ -1,29 +1,380 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __SWITCH__
+#include <sys/mman.h>
+#endif
 
 #include "mbc.h"
 
-struct mbc mbcs[4];
+struct mbc mbcs[6];
 
 void initMBCs() {
-    memset(mbcs[0].regs, 0x00, 4);
     mbcs[0].write8 = &mbc0_write8;
     mbcs[0].write16 = &mbc0_write16;
     mbcs[0].read8 = &mbc0_read8;
     mbcs[0].read16 = &mbc0_read16;
 
-    // All registers default to 00
-    memset(mbcs[1].regs, 0x00, 4);
     mbcs[1].write8 = &mbc1_write8;
     mbcs[1].write16 = &mbc1_write16;
     mbcs[1].read8 = &mbc1_read8;
     mbcs[1].read16 = &mbc1_read16;
 
-    memset(mbcs[3].regs, 0x00, 4);
     mbcs[3].write8 = &mbc3_write8;
     mbcs[3].write16 = &mbc3_write16;
     mbcs[3].read8 = &mbc3_read8;
     mbcs[3].read16 = &mbc3_read16;
+
+    mbcs[5].write8 = &mbc5_write8;
+    mbcs[5].write16 = &mbc5_write16;
+    mbcs[5].read8 = &mbc5_read8;
+    mbcs[5].read16 = &mbc5_read16;
+}
+
+/******************
+ ** Bank mapping **
+******************/
+// Bank switches resolve straight to a pointer, so reads cost the same
+// single load whether the ROM is 32KB or 8MB. Banks past the end of the
+// image wrap around, like the unconnected address lines on a real cart
+void cart_map_rom_bank(struct cart_t* cart, u16 bank) {
+    cart->romBank = bank % cart->romBanks;
+    cart->romBankPtr = cart->rom + cart->romBank * 0x4000;
+}
+
+// Has to be called again whenever cart->ram moves
+void cart_map_ram_bank(struct cart_t* cart, u8 bank) {
+    cart->ramBank = bank;
+    if(cart->ram == NULL) {
+        cart->ramBankPtr = NULL;
+        return;
+    }
+    cart->ramBankPtr = cart->ram + (bank * 0x2000) % cart->ramBytes;
+}
+
+/***************
+ ** MBC 3 RTC **
+***************/
+#define RTC_WRAP_SECONDS (512 * 86400)
+
+// Writable bits of each clock register
+static const u8 gRtcMasks[5] = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
+
+static void mbc3_rtc_reset(struct cart_t* cart) {
+    memset(&cart->rtc, 0, sizeof(cart->rtc));
+    cart->rtc.baseCycle = *cart->cycles;
+}
+
+// Seconds on the clock right now. Day counter overflow is folded into
+// the carry flag, keeping the base's fraction of a second
+static s64 mbc3_rtc_now(struct cart_t* cart) {
+    struct cart_rtc* rtc = &cart->rtc;
+    if(rtc->halted) {
+        return rtc->base;
+    }
+    s64 t = rtc->base + (s64)(*cart->cycles - rtc->baseCycle) / CART_RTC_HZ;
+    if(t >= RTC_WRAP_SECONDS) {
+        s64 wrapped = (t / RTC_WRAP_SECONDS) * RTC_WRAP_SECONDS;
+        rtc->base -= wrapped;
+        rtc->carry = true;
+        t -= wrapped;
+    }
+    return t;
+}
+
+static void mbc3_rtc_to_regs(const struct cart_rtc* rtc, s64 t, u8* regs) {
+    if(t < 0) {
+        t = 0;
+    }
+    u32 days = t / 86400;
+    regs[0] = t % 60;
+    regs[1] = (t / 60) % 60;
+    regs[2] = (t / 3600) % 24;
+    regs[3] = days & 0xFF;
+    regs[4] = ((days >> 8) & 0x1) | (rtc->halted? 0x40 : 0) | (rtc->carry? 0x80 : 0);
+}
+
+static s64 mbc3_rtc_from_regs(const u8* regs) {
+    s64 days = regs[3] | ((regs[4] & 0x1) << 8);
+    return days * 86400 + (regs[2] & 0x1F) * 3600 + (regs[1] & 0x3F) * 60 + (regs[0] & 0x3F);
+}
+
+// Latching copies the clock into the registers the game reads back
+static void mbc3_rtc_latch(struct cart_t* cart) {
+    mbc3_rtc_to_regs(&cart->rtc, mbc3_rtc_now(cart), cart->rtc.latched);
+}
+
+// Writing any register restarts the clock from the new value
+static void mbc3_rtc_write(struct cart_t* cart, u8 v) {
+    struct cart_rtc* rtc = &cart->rtc;
+    u8 reg = rtc->select - 0x08;
+    u8 regs[5];
+    mbc3_rtc_to_regs(rtc, mbc3_rtc_now(cart), regs);
+    regs[reg] = v & gRtcMasks[reg];
+    rtc->halted = regs[4] & 0x40;
+    rtc->carry = regs[4] & 0x80;
+    rtc->base = mbc3_rtc_from_regs(regs);
+    rtc->baseCycle = *cart->cycles;
+    rtc->latched[reg] = regs[reg];
+}
+
+static u32 rtc_get32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static void rtc_put32(u8* p, u32 v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+// Restores the clock from a .sav footer. The cart kept running while
+// the emulator was closed, so the wall clock time since then is added
+static void mbc3_rtc_load_sav(struct cart_t* cart, const u8* footer) {
+    struct cart_rtc* rtc = &cart->rtc;
+    u64 stamp = rtc_get32(footer + 40) | (u64) rtc_get32(footer + 44) << 32;
+    if(stamp == 0) {
+        // New file, no clock saved yet
+        return;
+    }
+    u8 regs[5];
+    for(int i = 0; i < 5; i++) {
+        regs[i] = rtc_get32(footer + i * 4);
+        rtc->latched[i] = rtc_get32(footer + 20 + i * 4);
+    }
+    rtc->halted = regs[4] & 0x40;
+    rtc->carry = regs[4] & 0x80;
+    rtc->base = mbc3_rtc_from_regs(regs);
+    rtc->baseCycle = *cart->cycles;
+    s64 elapsed = (s64) time(NULL) - (s64) stamp;
+    if(!rtc->halted && elapsed > 0) {
+        rtc->base += elapsed;
+    }
+}
+
+static void mbc3_rtc_store_sav(struct cart_t* cart, u8* footer) {
+    u8 regs[5];
+    mbc3_rtc_to_regs(&cart->rtc, mbc3_rtc_now(cart), regs);
+    for(int i = 0; i < 5; i++) {
+        rtc_put32(footer + i * 4, regs[i]);
+        rtc_put32(footer + 20 + i * 4, cart->rtc.latched[i]);
+    }
+    u64 stamp = time(NULL);
+    rtc_put32(footer + 40, stamp);
+    rtc_put32(footer + 44, stamp >> 32);
+}
+
+/***************
+ ** Cart RAM **
+***************/
+
+// Sizes for the ramSize header byte
+static const u8 gRamBanks[6] = { 0, 1, 1, 4, 16, 8 };
+
+// Allocates external RAM as described by the header and resets the
+// clock. Battery carts start with zeroed RAM until a .sav file is opened
+int cart_ram_init(struct cart_t* cart) {
+    cart->ramBanks = (cart->ramSize < 6)? gRamBanks[cart->ramSize] : 0;
+    cart->ramBytes = (cart->ramSize == 1)? 0x800 : cart->ramBanks * 0x2000;
+    cart->ramMask = (cart->ramSize == 1)? 0x7FF : 0x1FFF;
+    cart->ramBank = 0;
+    cart->ramBankPtr = NULL;
+    cart->ramEnabled = false;
+    cart->ramTouched = true;
+    cart->ramDirtyStart = cart->ramDirtyEnd = 0;
+    cart->framesSinceSync = 0;
+    cart->savPath = NULL;
+    cart->sav = NULL;
+    cart->savBytes = 0;
+    cart->ram = NULL;
+    cart->ramBacking = CART_RAM_NONE;
+    mbc3_rtc_reset(cart);
+    if(cart->ramBytes == 0) {
+        return 0;
+    }
+
+    cart->ram = (u8*) calloc(1, cart->ramBytes);
+    if(cart->ram == NULL) {
+        printf("Error: Could not allocate cartridge RAM!\n");
+        return -1;
+    }
+    cart->ramBacking = CART_RAM_HEAP;
+    cart_map_ram_bank(cart, 0);
+    return 0;
+}
+
+// Backs the RAM (and clock) of a battery cart with path, creating it if
+// needed. Writes land in the mapping directly and reach the disk through
+// cart_ram_frame()'s throttled, asynchronous msync
+int cart_ram_open_sav(struct cart_t* cart, const char* path) {
+    u32 savBytes = cart->ramBytes + (cart->hasRtc? CART_RTC_SAV_BYTES : 0);
+    if(!cart->battery || savBytes == 0) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        printf("Error: Could not open save file %s!\n", path);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (st.st_size < savBytes && ftruncate(fd, savBytes) < 0)) {
+        printf("Error: Could not size save file %s!\n", path);
+        close(fd);
+        return -1;
+    }
+
+#ifndef __SWITCH__
+    void* mapping = mmap(NULL, savBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        printf("Error: Could not map save file %s!\n", path);
+        return -1;
+    }
+    cart_ram_destroy(cart);
+    cart->sav = (u8*) mapping;
+    cart->savBytes = savBytes;
+    if(cart->ramBytes > 0) {
+        cart->ram = cart->sav;
+        cart->ramBacking = CART_RAM_MAPPED;
+        cart_map_ram_bank(cart, cart->ramBank);
+    }
+    if(cart->hasRtc) {
+        mbc3_rtc_load_sav(cart, cart->sav + cart->ramBytes);
+    }
+#else
+    // No mmap here, keep a copy and write it back when it changes
+    u8 footer[CART_RTC_SAV_BYTES] = { 0 };
+    bool ok = (read(fd, cart->ram, cart->ramBytes) >= 0);
+    if(ok && cart->hasRtc) {
+        ok = (read(fd, footer, sizeof(footer)) >= 0);
+    }
+    close(fd);
+    if(!ok) {
+        printf("Error: Could not read save file %s!\n", path);
+        return -1;
+    }
+    if(cart->hasRtc) {
+        mbc3_rtc_load_sav(cart, footer);
+    }
+    free(cart->savPath);
+    cart->savPath = strdup(path);
+#endif
+    cart->ramDirtyStart = cart->ramDirtyEnd = 0;
+    cart->framesSinceSync = 0;
+    printf("Using save file %s\n", path);
+    return 0;
+}
+
+// Writes back the RAM touched since the last sync. The clock is saved
+// along with it, and always when forced
+void cart_ram_sync(struct cart_t* cart, bool force) {
+    bool dirty = cart->ramDirtyEnd > cart->ramDirtyStart;
+    bool rtc = cart->hasRtc && (dirty || force);
+    if(!dirty && !rtc) {
+        return;
+    }
+    u32 start = dirty? cart->ramDirtyStart : cart->ramBytes;
+    u32 end = rtc? cart->ramBytes + CART_RTC_SAV_BYTES : cart->ramDirtyEnd;
+    if(cart->sav != NULL) {
+#ifndef __SWITCH__
+        if(rtc) {
+            mbc3_rtc_store_sav(cart, cart->sav + cart->ramBytes);
+        }
+        // msync wants a page aligned start
+        long pageSize = sysconf(_SC_PAGESIZE);
+        start &= ~(u32)(pageSize - 1);
+        msync(cart->sav + start, end - start, force? MS_SYNC : MS_ASYNC);
+#endif
+    } else if(cart->savPath != NULL) {
+        FILE* f = fopen(cart->savPath, "r+b");
+        if(f != NULL) {
+            if(dirty) {
+                fseek(f, cart->ramDirtyStart, SEEK_SET);
+                fwrite(cart->ram + cart->ramDirtyStart, 1, cart->ramDirtyEnd - cart->ramDirtyStart, f);
+            }
+            if(rtc) {
+                u8 footer[CART_RTC_SAV_BYTES];
+                mbc3_rtc_store_sav(cart, footer);
+                fseek(f, cart->ramBytes, SEEK_SET);
+                fwrite(footer, 1, sizeof(footer), f);
+            }
+            fclose(f);
+        }
+    }
+    cart->ramDirtyStart = cart->ramDirtyEnd = 0;
+    cart->framesSinceSync = 0;
+}
+
+// Called once per frame
+void cart_ram_frame(struct cart_t* cart) {
+    if(cart->ramDirtyEnd > cart->ramDirtyStart && ++cart->framesSinceSync >= CART_SAV_SYNC_FRAMES) {
+        cart_ram_sync(cart, false);
+    }
+}
+
+void cart_ram_destroy(struct cart_t* cart) {
+    cart_ram_sync(cart, true);
+    if(cart->ramBacking == CART_RAM_HEAP) {
+        free(cart->ram);
+    }
+#ifndef __SWITCH__
+    // Mapped RAM lives in here
+    if(cart->sav != NULL) {
+        munmap(cart->sav, cart->savBytes);
+    }
+#endif
+    cart->sav = NULL;
+    cart->savBytes = 0;
+    free(cart->savPath);
+    cart->savPath = NULL;
+    cart->ram = NULL;
+    cart->ramBankPtr = NULL;
+    cart->ramBacking = CART_RAM_NONE;
+}
+
+u8 cart_ram_read8(struct cart_t* cart, u16 addr) {
+    if(!cart->ramEnabled) {
+        return 0xFF;
+    }
+    if(cart->rtc.select) {
+        return cart->rtc.latched[cart->rtc.select - 0x08];
+    }
+    if(cart->ramBankPtr == NULL) {
+        return 0xFF;
+    }
+    return cart->ramBankPtr[addr & cart->ramMask];
+}
+
+void cart_ram_write8(struct cart_t* cart, u16 addr, u8 v) {
+    if(!cart->ramEnabled) {
+        return;
+    }
+    if(cart->rtc.select) {
+        mbc3_rtc_write(cart, v);
+        return;
+    }
+    if(cart->ramBankPtr == NULL) {
+        return;
+    }
+    u8* p = cart->ramBankPtr + (addr & cart->ramMask);
+    *p = v;
+    cart->ramTouched = true;
+    if(!cart->battery) {
+        return;
+    }
+    u32 offs = p - cart->ram;
+    if(cart->ramDirtyEnd <= cart->ramDirtyStart) {
+        cart->ramDirtyStart = offs;
+        cart->ramDirtyEnd = offs + 1;
+    } else {
+        if(offs < cart->ramDirtyStart)
+            cart->ramDirtyStart = offs;
+        if(offs >= cart->ramDirtyEnd)
+            cart->ramDirtyEnd = offs + 1;
+    }
 }
 
 /***********
@@ -55,15 +406,17 @@ u16 mbc0_read16(struct cart_t* cart, u16 addr) {
 /***********
  ** MBC 1 **
 ************/
+// RAM banks are only switched in advanced banking mode
+static void mbc1_update_ram_bank(struct cart_t* cart) {
+    bool banked = cart->regs[MBC1_MODE] && cart->ramBanks > 1;
+    cart_map_ram_bank(cart, banked? cart->regs[MBC1_RAMBANK] : 0);
+}
+
 void mbc1_write8(struct cart_t* cart, u16 addr, u8 v) {
     if(addr >= 0x0000 && addr < 0x2000) {
-        if((v & 0xF) == 0xA) {
-            printf("MBC1: Enabling RAM\n");
-            cart->mbc->regs[MBC1_RAMENABLE] = 1;
-        } else {
-            printf("MBC1: Disabling RAM\n");
-            cart->mbc->regs[MBC1_RAMENABLE] = 0;
-        }
+        // Games toggle this around every save, so no logging here
+        cart->regs[MBC1_RAMENABLE] = ((v & 0xF) == 0xA);
+        cart->ramEnabled = cart->regs[MBC1_RAMENABLE];
     }
     else if(addr >= 0x2000 && addr < 0x4000) {
         // Mask to only the number of bits needed
@@ -74,7 +427,7 @@ void mbc1_write8(struct cart_t* cart, u16 addr, u8 v) {
         u8 mask = (1 << (romSize + 1)) - 1;
         u8 bank = v & mask;
         if(cart->romSize >= 5)
-            bank = (cart->mbc->regs[MBC1_RAMBANK] << 5) | bank;
+            bank = (cart->regs[MBC1_RAMBANK] << 5) | bank;
         // A quirk here is that if the rom size is <= 256KB
         // you can map bank 0 to 0x4000-7FFF, because this
         // check masks using the full 5 bits rather than the mask
@@ -84,14 +437,20 @@ void mbc1_write8(struct cart_t* cart, u16 addr, u8 v) {
         // become 21, 41, and 61, respectively.
         if((v & 0x1F) == 0x00)
             bank++;
-        cart->mbc->regs[MBC1_ROMBANK] = bank;
+        cart->regs[MBC1_ROMBANK] = bank;
+        cart_map_rom_bank(cart, bank);
     }
     else if(addr >= 0x4000 && addr < 0x6000) {
         // Only modify this register if we have
         // enough ROM size or RAM size
         if(cart->romSize >= 5 || cart->ramSize == 3) {
-            cart->mbc->regs[MBC1_RAMBANK] = v & 0x3;
+            cart->regs[MBC1_RAMBANK] = v & 0x3;
         }
+        mbc1_update_ram_bank(cart);
+    }
+    else if(addr >= 0x6000 && addr < 0x8000) {
+        cart->regs[MBC1_MODE] = v & 0x1;
+        mbc1_update_ram_bank(cart);
     }
 }
 
@@ -105,9 +464,7 @@ u8 mbc1_read8(struct cart_t* cart, u16 addr) {
         return cart->rom[addr];
     }
     else if(addr >= 0x4000 && addr < 0x8000) {
-        u8 bank = cart->mbc->regs[MBC1_ROMBANK];
-        u32 offs = bank * 0x4000 + (addr - 0x4000);
-        return cart->rom[offs];
+        return cart->romBankPtr[addr - 0x4000];
     }
     return 0xFF;
 }
@@ -126,16 +483,15 @@ u16 mbc1_read16(struct cart_t* cart, u16 addr) {
         bottomByte = cart->rom[addr];
     }
     else if(addr >= 0x4000 && addr < 0x8000) {
-        u8 bank = cart->mbc->regs[MBC1_ROMBANK];
-        u32 offs = bank * 0x4000 + (addr - 0x4000);
+        u32 offs = addr - 0x4000;
 
         if(addr == 0x7FFF) {
             printf("MBC1: Reading 16-bit value at the edge of a bank. Using 0xFF as the top byte!\n");
             topByte = 0xFF;
         } else {
-            topByte = cart->rom[offs + 1];
+            topByte = cart->romBankPtr[offs + 1];
         }
-        bottomByte = cart->rom[offs];
+        bottomByte = cart->romBankPtr[offs];
     }
 
     return bottomByte | (topByte << 8);
@@ -145,11 +501,29 @@ u16 mbc1_read16(struct cart_t* cart, u16 addr) {
  ** MBC 3 **
 ************/
 void mbc3_write8(struct cart_t* cart, u16 addr, u8 v) {
-    if(addr >= 0x2000 && addr < 0x4000) {
+    if(addr < 0x2000) {
+        cart->regs[MBC3_RAMENABLE] = ((v & 0xF) == 0xA);
+        cart->ramEnabled = cart->regs[MBC3_RAMENABLE];
+    }
+    else if(addr >= 0x4000 && addr < 0x6000) {
+        // 0x08-0x0C map a clock register instead of RAM
+        cart->regs[MBC3_RAMBANK] = v & 0x0F;
+        cart->rtc.select = (cart->hasRtc && v >= 0x08 && v <= 0x0C)? v : 0;
+        cart_map_ram_bank(cart, v & 0x03);
+    }
+    else if(addr >= 0x6000 && addr < 0x8000) {
+        // Writing 0x00 then 0x01 latches the clock
+        if(cart->regs[MBC3_LATCH] == 0x00 && v == 0x01 && cart->hasRtc) {
+            mbc3_rtc_latch(cart);
+        }
+        cart->regs[MBC3_LATCH] = v;
+    }
+    else if(addr >= 0x2000 && addr < 0x4000) {
         u8 bank = v & 0x7F;
         if(bank == 0x00)
             bank++;
-        cart->mbc->regs[MBC3_ROMBANK] = bank;
+        cart->regs[MBC3_ROMBANK] = bank;
+        cart_map_rom_bank(cart, bank);
     }
 }
 
@@ -163,9 +537,7 @@ u8 mbc3_read8(struct cart_t* cart, u16 addr) {
         return cart->rom[addr];
     }
     else if(addr >= 0x4000 && addr < 0x8000) {
-        u8 bank = cart->mbc->regs[MBC3_ROMBANK];
-        u32 offs = bank * 0x4000 + (addr - 0x4000);
-        return cart->rom[offs];
+        return cart->romBankPtr[addr - 0x4000];
     }
     return 0xFF;
 }
@@ -184,17 +556,59 @@ u16 mbc3_read16(struct cart_t* cart, u16 addr) {
         bottomByte = cart->rom[addr];
     }
     else if(addr >= 0x4000 && addr < 0x8000) {
-        u8 bank = cart->mbc->regs[MBC3_ROMBANK];
-        u32 offs = bank * 0x4000 + (addr - 0x4000);
+        u32 offs = addr - 0x4000;
 
         if(addr == 0x7FFF) {
             printf("MBC1: Reading 16-bit value at the edge of a bank. Using 0xFF as the top byte!\n");
             topByte = 0xFF;
         } else {
-            topByte = cart->rom[offs + 1];
+            topByte = cart->romBankPtr[offs + 1];
         }
-        bottomByte = cart->rom[offs];
+        bottomByte = cart->romBankPtr[offs];
     }
 
     return bottomByte | (topByte << 8);
 }
+
+/***********
+ ** MBC 5 **
+************/
+void mbc5_write8(struct cart_t* cart, u16 addr, u8 v) {
+    if(addr < 0x2000) {
+        cart->regs[MBC5_RAMENABLE] = ((v & 0xF) == 0xA);
+        cart->ramEnabled = cart->regs[MBC5_RAMENABLE];
+    }
+    else if(addr >= 0x2000 && addr < 0x3000) {
+        // Low 8 bits of the 9-bit ROM bank. Unlike MBC1 and 3,
+        // bank 0 can be mapped at 0x4000-0x7FFF too
+        cart->regs[MBC5_ROMBANKLO] = v;
+        cart_map_rom_bank(cart, (cart->regs[MBC5_ROMBANKHI] << 8) | v);
+    }
+    else if(addr >= 0x3000 && addr < 0x4000) {
+        cart->regs[MBC5_ROMBANKHI] = v & 0x1;
+        cart_map_rom_bank(cart, (cart->regs[MBC5_ROMBANKHI] << 8) | cart->regs[MBC5_ROMBANKLO]);
+    }
+    else if(addr >= 0x4000 && addr < 0x6000) {
+        // Rumble carts drive the motor with bit 3 rather than a RAM address line
+        u8 mask = (cart->mbcCode >= 0x1C)? 0x07 : 0x0F;
+        cart->regs[MBC5_RAMBANK] = v & 0x0F;
+        cart_map_ram_bank(cart, v & mask);
+    }
+}
+
+void mbc5_write16(struct cart_t* cart, u16 addr, u16 v) {
+    return;
+}
+
+u8 mbc5_read8(struct cart_t* cart, u16 addr) {
+    addr &= 0x7FFF;
+    if(addr < 0x4000) {
+        return cart->rom[addr];
+    }
+    return cart->romBankPtr[addr - 0x4000];
+}
+
+// gb_read16 never passes 0x7FFF, so only 0x3FFF straddles two banks
+u16 mbc5_read16(struct cart_t* cart, u16 addr) {
+    return mbc5_read8(cart, addr) | (mbc5_read8(cart, addr + 1) << 8);
+}
@@ -0,0 +1,103 @@
+#ifdef DIJON_OPCODE_STATS
+
+#include "opstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "instructions.h"
+
+
+void opstats_reset(struct cpu* cpu) {
+    memset(cpu->opcodeStats, 0, sizeof(cpu->opcodeStats));
+}
+
+// Turns table entries like "LD B, " into "LD B, u8"
+static void opstats_name(u16 index, char* out, size_t outLen) {
+    const char* disasm = instructions[index].disasm;
+    size_t len = strlen(disasm);
+    bool hasOperand = (len > 0 && disasm[len - 1] == ' ' && strstr(disasm, "xx") == NULL);
+    while(len > 0 && disasm[len - 1] == ' ')
+        len--;
+
+    const char* operand = "";
+    if(hasOperand && index < 256) {
+        operand = (instructions[index].len == 2)? " u8" : " u16";
+    }
+    snprintf(out, outLen, "%.*s%s", (int) len, disasm, operand);
+}
+
+// A copy of one table entry, so sorting doesn't need the table
+struct opstats_entry {
+    u16 opcode;
+    struct opcode_stats stats;
+};
+
+static int opstats_compare(const void* a, const void* b) {
+    u64 ca = ((const struct opstats_entry*) a)->stats.cycles;
+    u64 cb = ((const struct opstats_entry*) b)->stats.cycles;
+    return (ca < cb) - (ca > cb);
+}
+
+int opstats_write(struct cpu* cpu, const char* path) {
+    FILE* f;
+    if((f = fopen(path, "w")) == NULL) {
+        printf("Error opening opcode stats file %s!\n", path);
+        return -1;
+    }
+
+    size_t pathLen = strlen(path);
+    bool json = (pathLen >= 5 && strcmp(path + pathLen - 5, ".json") == 0);
+
+    // Heaviest opcodes first, skipping ones that never ran
+    struct opstats_entry order[512];
+    int n = 0;
+    u64 totalCycles = 0;
+    for(int i = 0; i < 512; i++) {
+        if(cpu->opcodeStats[i].count > 0) {
+            order[n].opcode = i;
+            order[n].stats = cpu->opcodeStats[i];
+            n++;
+        }
+        totalCycles += cpu->opcodeStats[i].cycles;
+    }
+    qsort(order, n, sizeof(struct opstats_entry), opstats_compare);
+
+    if(json)
+        fprintf(f, "[\n");
+    else
+        fprintf(f, "opcode,disasm,count,cycles,cycle_share\n");
+
+    for(int i = 0; i < n; i++) {
+        u16 index = order[i].opcode;
+        const struct opcode_stats* s = &order[i].stats;
+        char name[40];
+        char opcode[8];
+        opstats_name(index, name, sizeof(name));
+        if(index >= 256)
+            sprintf(opcode, "CB %02X", index - 256);
+        else
+            sprintf(opcode, "%02X", index);
+        double share = totalCycles? (double) s->cycles / totalCycles : 0.0;
+
+        if(json) {
+            fprintf(f, "  {\"opcode\": \"%s\", \"disasm\": \"%s\", \"count\": %llu, \"cycles\": %llu, \"cycleShare\": %.6f}%s\n",
+                    opcode, name, (unsigned long long) s->count, (unsigned long long) s->cycles, share,
+                    (i + 1 < n)? "," : "");
+        }
+        else {
+            fprintf(f, "%s,\"%s\",%llu,%llu,%.6f\n",
+                    opcode, name, (unsigned long long) s->count, (unsigned long long) s->cycles, share);
+        }
+    }
+
+    if(json)
+        fprintf(f, "]\n");
+
+    fclose(f);
+    return 0;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "ppu.h"
 #include "gb.h"
 #include "cpu.h"
+#include "hostprof.h"
 
 #include <string.h>
 
@@ -11,7 +12,50 @@ const u32 gColors[4] = {
     0xFF0F380F  // Darkest
 };
 
+// Every byte with its bits in reverse order, for X flipped objects
+#define REV2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define REV4(n) REV2(n), REV2(n + 2*16), REV2(n + 1*16), REV2(n + 3*16)
+#define REV6(n) REV4(n), REV4(n + 2*4), REV4(n + 1*4), REV4(n + 3*4)
+const u8 gReverseBits[256] = { REV6(0), REV6(2), REV6(1), REV6(3) };
+
+static int ppu_scanline_run(struct ppu* ppu);
+
+const struct ppu_renderer gPPURenderers[PPU_RENDERER_COUNT] = {
+    [PPU_RENDERER_SCANLINE] = { "Scanline", NULL, ppu_scanline_run },
+    [PPU_RENDERER_FIFO] = { "Pixel FIFO", ppu_fifo_begin, ppu_fifo_run },
+};
+
 void ppu_init(struct ppu* ppu, struct gb* gb) {
+    ppu->outExternal = false;
+    ppu_bind(ppu, gb);
+
+    // Start in OAM Search
+    ppu->stat->mode = 0x02;
+    *ppu->scy = 0x00;
+    *ppu->scx = 0x00;
+    *ppu->ly = 0x00;
+    *ppu->lyc = 0x00;
+    *ppu->bgp = 0xE4;  // 0b11100100
+    *ppu->obp0 = 0xE4; // ^
+    *ppu->obp1 = 0xE4; // ^
+    *ppu->wy = 0x00;
+    *ppu->wx = 0x00;
+    ppu->objsThisScanline = 0;
+    ppu->objIndexDirty = true;
+    ppu->hblankCycles = 51;
+    ppu->renderer = &gPPURenderers[PPU_RENDERER_SCANLINE];
+    memset(&ppu->fifo, 0, sizeof(ppu->fifo));
+    ppu->winLine = 0;
+    ppu->winTriggered = false;
+
+    // Start out blank, in the lightest shade
+    memset(ppu->shades, 0, sizeof(ppu->shades));
+    ppu_set_output(ppu, NULL, 0, PPU_FORMAT_ARGB8888);
+    ppu_repaint_output(ppu);
+}
+
+// Points the register shortcuts at gb's memory
+void ppu_bind(struct ppu* ppu, struct gb* gb) {
     ppu->gb = gb;
 
     ppu->lcdc = (struct lcdc_t*) gb_get_mmap_ptr(gb, 0xFF40);
@@ -26,22 +70,96 @@ void ppu_init(struct ppu* ppu, struct gb* gb) {
     ppu->wy   = gb_get_mmap_ptr(gb, 0xFF4A);
     ppu->wx   = gb_get_mmap_ptr(gb, 0xFF4B);
     ppu->objs = (struct obj_t*) gb_get_mmap_ptr(gb, 0xFE00);
+    ppu->vram = gb_get_mmap_ptr(gb, 0x8000);
+    if(!ppu->outExternal) {
+        ppu->outPixels = (u8*) ppu->framebuffer;
+    }
+}
 
-    // Start in OAM Search
-    ppu->stat->mode = 0x02;
-    *ppu->scy = 0x00;
-    *ppu->scx = 0x00;
-    *ppu->ly = 0x00;
-    *ppu->lyc = 0x00;
-    *ppu->bgp = 0xE4;  // 0b11100100
-    *ppu->obp0 = 0xE4; // ^
-    *ppu->obp1 = 0xE4; // ^
-    *ppu->wy = 0x00;
-    *ppu->wx = 0x00;
+// Has the PPU write finished scanlines straight into pixels, e.g. a locked
+// texture, instead of ppu->framebuffer. pitch is the bytes per row and
+// the surface must hold 160x144 pixels. NULL goes back to framebuffer.
+// Only scanlines that change are drawn, so the surface has to keep its
+// contents; ppu_repaint_output() fills it in to begin with
+void ppu_set_output(struct ppu* ppu, void* pixels, int pitch, enum ppu_format_e format) {
+    ppu->outExternal = (pixels != NULL);
+    if(pixels == NULL) {
+        pixels = ppu->framebuffer;
+        pitch = 160 * sizeof(u32);
+        format = PPU_FORMAT_ARGB8888;
+    }
+    ppu->outPixels = (u8*) pixels;
+    ppu->outPitch = pitch;
+    ppu->outFormat = format;
+
+    for(int c = 0; c < 4; c++) {
+        u32 argb = gColors[c];
+        switch(format) {
+            case PPU_FORMAT_ARGB8888:
+                ppu->outColors[c] = argb;
+                break;
+            case PPU_FORMAT_RGB565:
+                ppu->outColors[c] = ((argb >> 8) & 0xF800) | ((argb >> 5) & 0x07E0) | ((argb >> 3) & 0x001F);
+                break;
+            case PPU_FORMAT_SHADE8:
+                ppu->outColors[c] = c;
+                break;
+        }
+    }
+}
+
+static void ppu_output_line(struct ppu* ppu, int y) {
+    const u8* shades = ppu->shades[y];
+    u8* row = ppu->outPixels + y * ppu->outPitch;
+    switch(ppu->outFormat) {
+        case PPU_FORMAT_ARGB8888:
+            for(int x = 0; x < 160; x++)
+                ((u32*) row)[x] = ppu->outColors[shades[x]];
+            break;
+        case PPU_FORMAT_RGB565:
+            for(int x = 0; x < 160; x++)
+                ((u16*) row)[x] = ppu->outColors[shades[x]];
+            break;
+        case PPU_FORMAT_SHADE8:
+            memcpy(row, shades, 160);
+            break;
+    }
+}
+
+// Redraws the whole frame into the output, and reports every line as
+// changed since whatever was on screen before is unknown
+void ppu_repaint_output(struct ppu* ppu) {
+    for(int y = 0; y < 144; y++) {
+        ppu_output_line(ppu, y);
+    }
+    memset(ppu->changedLines, 0xFF, sizeof(ppu->changedLines));
+}
+
+// Copies out the lines whose pixels changed since the last call and
+// clears them, so frontends can skip uploading the rest. Returns false
+// if nothing changed. Meant for a single consumer per instance
+bool ppu_take_changed_lines(struct ppu* ppu, u64 lines[PPU_LINE_WORDS]) {
+    bool any = false;
+    for(int i = 0; i < PPU_LINE_WORDS; i++) {
+        lines[i] = ppu->changedLines[i];
+        any |= (lines[i] != 0);
+        ppu->changedLines[i] = 0;
+    }
+    // Bits past line 143 aren't lines
+    lines[PPU_LINE_WORDS - 1] &= (1ULL << (144 - 128)) - 1;
+    return any;
+}
+
+// Takes effect from the next line if switched during mode 3
+void ppu_set_renderer(struct ppu* ppu, enum ppu_renderer_e renderer) {
+    ppu->renderer = &gPPURenderers[renderer];
+    if(ppu->stat->mode == 0x03 && ppu->renderer->begin != NULL) {
+        ppu->renderer->begin(ppu);
+    }
+}
 
-    // Fill with gColors[0]
-    for(int i = 0; i < 160*144; i++)
-        ppu->framebuffer[i] = gColors[0];
+enum ppu_renderer_e ppu_get_renderer(const struct ppu* ppu) {
+    return (enum ppu_renderer_e) (ppu->renderer - gPPURenderers);
 }
 
 bool ppu_run(struct ppu* ppu, int lastCpuCycles) {
@@ -52,21 +170,22 @@ bool ppu_run(struct ppu* ppu, int lastCpuCycles) {
     ppu->cyclesThisMode += lastCpuCycles;
 
     switch(ppu->stat->mode) {
-        // hblank: 51 cycles
+        // hblank: the rest of the line's 114 cycles, 51 after a 43 cycle
+        // mode 3
         case 0x00:
-            if(ppu->cyclesThisMode >= 51) {
+            if(ppu->cyclesThisMode >= ppu->hblankCycles) {
                 ppu_hblank(ppu);
                 // Incrememnt ly after hblank completes. If we hit line 144,
                 // go to vblank, otherwise go to oam search
                 (*ppu->ly)++;
                 if(*ppu->ly >= 144) {
                     ppu->stat->mode = 0x01;
-                    ppu->vblankCycles = ppu->cyclesThisMode % 51;
+                    ppu->vblankCycles = ppu->cyclesThisMode - ppu->hblankCycles;
                     cpu_request_interrupt(ppu->gb->cpu, INTERRUPT_VBLANK);
                 } else {
                     ppu->stat->mode = 0x02;
                 }
-                ppu->cyclesThisMode %= 51;
+                ppu->cyclesThisMode -= ppu->hblankCycles;
             }
             break;
         // vblank: 1140 cycles
@@ -92,16 +211,21 @@ bool ppu_run(struct ppu* ppu, int lastCpuCycles) {
                 ppu_oamsearch(ppu);
                 ppu->stat->mode = 0x03;
                 ppu->cyclesThisMode %= 20;
+                if(ppu->renderer->begin != NULL) {
+                    ppu->renderer->begin(ppu);
+                }
             }
             break;
-        // data transfer
-        case 0x03:
-            if(ppu->cyclesThisMode >= 43) {
-                ppu_scanline(ppu);
+        // data transfer: 43 cycles or more, up to the renderer
+        case 0x03: {
+            int length = ppu->renderer->run(ppu);
+            if(length > 0) {
                 ppu->stat->mode = 0x00;
-                ppu->cyclesThisMode %= 43;
+                ppu->cyclesThisMode -= length;
+                ppu->hblankCycles = 94 - length;
             }
             break;
+        }
     }
 
     return false;
@@ -116,125 +240,229 @@ void ppu_hblank(struct ppu* ppu) {
 }
 
 void ppu_vblank(struct ppu* ppu) {
+    ppu->winLine = 0;
+    ppu->winTriggered = false;
 
 }
 
-void ppu_oamsearch(struct ppu* ppu) {
-    u16 oamRAM = 0xFE00;
-    u8 objH = (ppu->lcdc->obj8x16)? 16 : 8;
-    u8 y = *ppu->ly;
+// Buckets every object into the lines it covers. Walking OAM in order
+// keeps the first 10 objects of each line, like the per-line search
+void ppu_index_objs(struct ppu* ppu) {
+    int objH = (ppu->lcdc->obj8x16)? 16 : 8;
 
+    memset(ppu->lineObjCount, 0, sizeof(ppu->lineObjCount));
     for(int a = 0; a < 40; a++) {
-        int objY = (int) gb_read8(ppu->gb, oamRAM + (a * 4)) - objH;
-        if(objY >= y && objY < (y + objH)) {
-            ppu->scanlineObjs[ppu->objsThisScanline++] = a;
-            if(ppu->objsThisScanline == 10) {
-                break;
+        // Y is the bottom of an 8x16 object, plus 16
+        int first = ppu->objs[a].y - 16;
+        int last = first + objH - 1;
+        if(first < 0)
+            first = 0;
+        if(last > 143)
+            last = 143;
+        for(int line = first; line <= last; line++) {
+            if(ppu->lineObjCount[line] < 10) {
+                ppu->lineObjs[line][ppu->lineObjCount[line]++] = a;
             }
         }
     }
+    ppu->objIndexDirty = false;
 }
 
-void ppu_scanline(struct ppu* ppu)  {
-    for(int x = 0; x < 20*8; x++) {
-        // TODO: Implement SCX
-        int y = *ppu->ly;
-        u8 ySc = *ppu->scy;
-        int xTile = x / 8;
-        int yTile = (y / 8) + (ySc / 8);
-        int xPixel = x % 8;
-        int yPixel = y % 8;
-        int yScPx = ySc % 8;
-        yPixel += yScPx;
-        
-        u16 bgMapStart = (ppu->lcdc->bgMapArea)? 0x9C00 : 0x9800;
-        if(yPixel > 7) {
-            yPixel %= 8;
-            yTile++;
+void ppu_oamsearch(struct ppu* ppu) {
+    u8 y = *ppu->ly;
+    if(y >= 144) {
+        ppu->objsThisScanline = 0;
+        return;
+    }
+    if(ppu->lcdc->windowOn && y == *ppu->wy) {
+        ppu->winTriggered = true;
+    }
+    if(ppu->objIndexDirty) {
+        ppu_index_objs(ppu);
+    }
+    ppu->objsThisScanline = ppu->lineObjCount[y];
+    memcpy(ppu->scanlineObjs, ppu->lineObjs[y], sizeof(ppu->scanlineObjs));
+}
+
+// The 8 mask bits for the pixels from x on, x may be -8 to 160
+static inline u8 ppu_line_mask_get(const u8* mask, int x) {
+    int bit = x + 8;
+    u16 pair = (mask[bit >> 3] << 8) | mask[(bit >> 3) + 1];
+    return (pair << (bit & 7)) >> 8;
+}
+
+static inline void ppu_line_mask_set(u8* mask, int x, u8 bits) {
+    int bit = x + 8;
+    mask[bit >> 3] |= bits >> (bit & 7);
+    mask[(bit >> 3) + 1] |= bits << (8 - (bit & 7));
+}
+
+static int ppu_scanline_run(struct ppu* ppu) {
+    if(ppu->cyclesThisMode < 43) {
+        return 0;
+    }
+    u64 start = (ppu->gb->perf.timePpu)? hostprof_now() : 0;
+    ppu_scanline(ppu);
+    if(start != 0) {
+        ppu->gb->perf.ppuNs += hostprof_now() - start;
+    }
+    return 43;
+}
+
+// Draws screen pixels from x to end - 1 of a BG or window map row, one
+// tile row fetch per 8 pixels. srcX is the map pixel at x
+static void ppu_scanline_tiles(struct ppu* ppu, const u8* mapRow, int srcX, int fine, int x, int end) {
+    u8 palette[4];
+    for(int c = 0; c < 4; c++) {
+        palette[c] = (*ppu->bgp >> (c * 2)) & 0x3;
+    }
+
+    while(x < end) {
+        u8 id = mapRow[(srcX >> 3) & 31];
+        // 8000h addressing takes unsigned ids, 8800h signed ones from 9000h
+        int tile = (ppu->lcdc->bgTilesArea)? id : 0x100 + (s8) id;
+        const u8* tileRow = ppu->vram + tile * 16 + fine * 2;
+        u8 lo = tileRow[0];
+        u8 hi = tileRow[1];
+
+        int first = srcX & 7;
+        int count = 8 - first;
+        if(count > end - x) {
+            count = end - x;
         }
-        yTile %= 32;
-        u16 bgMapOffset = (yTile * 32) + xTile;
-        if(bgMapOffset >= 0x400) {
-            printf("Warning: BG Map offset %#04x is out of range!\n", bgMapOffset);
+        u8 bits = (0xFF >> first) & (0xFF << (8 - first - count));
+        ppu_line_mask_set(ppu->bgLineMask, x - first, (lo | hi) & bits);
+        for(int px = first; px < first + count; px++) {
+            int shift = 7 - px;
+            ppu->line[x++] = palette[((lo >> shift) & 1) | (((hi >> shift) & 1) << 1)];
         }
-        s8 tileId = (s8) gb_read8(ppu->gb, bgMapStart + bgMapOffset);
-        u16 bgTilesOffset = (ppu->lcdc->bgTilesArea)? 0x8000 : 0x9000;
-        u16 bgTileAddr = (ppu->lcdc->bgTilesArea)? (bgTilesOffset + ((u8)tileId * 16)) : (bgTilesOffset + (tileId * 16));
+        srcX += count;
+    }
+}
+
+void ppu_scanline(struct ppu* ppu)  {
+    HOSTPROF_SCOPE(HOSTPROF_PPU_SCANLINE);
+
+    memset(ppu->bgLineMask, 0, sizeof(ppu->bgLineMask));
+    if(ppu->lcdc->bgDispOn) {
+        int y = *ppu->ly;
 
-        u16 tileLineOffset = bgTileAddr + (yPixel * 2);
-        
-        u8 lineBytes[2] = { gb_read8(ppu->gb, tileLineOffset), gb_read8(ppu->gb, tileLineOffset + 1) };
-        u8 pixelBitMask = (1 << (7 - xPixel));
-        
-        u8 colorHigh = (lineBytes[1] & pixelBitMask) >> (7 - xPixel);
-        u8 colorLow =  (lineBytes[0] & pixelBitMask) >> (7 - xPixel);
-        u8 twoBitColor = colorLow | (colorHigh << 1);
-        u8 bgp = *ppu->bgp;
-        u8 bgpColor = (bgp >> (twoBitColor * 2)) & 0x3;
+        // The window covers the BG from WX - 7 to the right edge
+        int winX = 160;
+        if(ppu->lcdc->windowOn && ppu->winTriggered && *ppu->wx < 167) {
+            winX = *ppu->wx - 7;
+            if(winX < 0)
+                winX = 0;
+        }
 
-        u32 finalColor = gColors[bgpColor];
+        u8 bgY = y + *ppu->scy;
+        const u8* bgMap = ppu->vram + ((ppu->lcdc->bgMapArea)? 0x1C00 : 0x1800);
+        ppu_scanline_tiles(ppu, bgMap + (bgY >> 3) * 32, *ppu->scx, bgY & 7, 0, winX);
 
-        ppu->framebuffer[(y * 160) + x] = finalColor;
+        if(winX < 160) {
+            const u8* winMap = ppu->vram + ((ppu->lcdc->winMapArea)? 0x1C00 : 0x1800);
+            int srcX = winX - (*ppu->wx - 7);
+            ppu_scanline_tiles(ppu, winMap + (ppu->winLine >> 3) * 32, srcX, ppu->winLine & 7, winX, 160);
+            ppu->winLine++;
+        }
+    } else {
+        // Blank, in the lightest shade
+        memset(ppu->line, 0, sizeof(ppu->line));
     }
 
     ppu_scanline_objs(ppu);
+    ppu_commit_line(ppu);
+}
+
+// Stores the finished line in shades. Lines identical to the last frame
+// are left alone, the rest are flagged and drawn to the output
+void ppu_commit_line(struct ppu* ppu) {
+    int y = *ppu->ly;
+    if(memcmp(ppu->line, ppu->shades[y], sizeof(ppu->line)) != 0) {
+        memcpy(ppu->shades[y], ppu->line, sizeof(ppu->line));
+        ppu->changedLines[y >> 6] |= 1ULL << (y & 63);
+        ppu_output_line(ppu, y);
+    }
 }
 
+// Draws the line's objects a whole 8 pixel row at a time. Each pixel goes
+// to the highest priority object that is opaque there: lowest X first,
+// then lowest OAM index. Objects with the priority bit set then only
+// show over BG colour 0
 void ppu_scanline_objs(struct ppu* ppu) {
-    u8 y = *ppu->ly;
-    u16 oamRAM = 0xFE00;
-    u16 tileRAM = 0x8000;
-    u8 objH = (ppu->lcdc->obj8x16)? 16 : 8;
-
-    for(int i = 0; i < ppu->objsThisScanline; i++) {
-        u8 thisObj = ppu->scanlineObjs[i];
-        u16 thisObjAddr = oamRAM + (thisObj * 4);
-        u8 objY = gb_read8(ppu->gb, thisObjAddr);
-        u8 objX = gb_read8(ppu->gb, thisObjAddr + 1);
-        u8 objTile = gb_read8(ppu->gb, thisObjAddr + 2);
-        u8 objAttr = gb_read8(ppu->gb, thisObjAddr + 3);
-        // Get the line number of the tile we want
-        u8 yPx = y - objY;
-        yPx %= objH;
-        if(yPx >= objH) {
-            printf("OBJ pxY %d over sprite height!\n", yPx);
-            continue;
+    int count = ppu->objsThisScanline;
+    ppu->objsThisScanline = 0;
+    if(!ppu->lcdc->objDispOn || count == 0) {
+        return;
+    }
+
+    int y = *ppu->ly;
+    int objH = (ppu->lcdc->obj8x16)? 16 : 8;
+    u8* line = ppu->line;
+
+    // Resolve both palettes once per line
+    u8 palettes[2][4];
+    for(int c = 0; c < 4; c++) {
+        palettes[0][c] = (*ppu->obp0 >> (c * 2)) & 0x3;
+        palettes[1][c] = (*ppu->obp1 >> (c * 2)) & 0x3;
+    }
+
+    // Sort into drawing priority. Stable, so OAM order breaks ties
+    struct obj_t* objs[10];
+    for(int i = 0; i < count; i++) {
+        struct obj_t* obj = &ppu->objs[ppu->scanlineObjs[i]];
+        int j = i;
+        while(j > 0 && objs[j - 1]->x > obj->x) {
+            objs[j] = objs[j - 1];
+            j--;
         }
-        // Don't draw tiles that are off the top of the screen
-        if((objY + objH) <= 16) {
-            printf("OBJ off top of screen! %d\n", objY);
+        objs[j] = obj;
+    }
+
+    // The padding counts as taken, so nothing is drawn off screen
+    memset(ppu->objLineMask, 0, sizeof(ppu->objLineMask));
+    ppu->objLineMask[0] = 0xFF;
+    ppu->objLineMask[21] = 0xFF;
+
+    for(int i = 0; i < count; i++) {
+        struct obj_t* obj = objs[i];
+        int x = obj->x - 8;
+        if(x <= -8 || x >= 160) {
             continue;
         }
 
-        u8 lineByte1 = gb_read8(ppu->gb, tileRAM + (objTile * 16) + (yPx * 2));
-        u8 lineByte2 = gb_read8(ppu->gb, tileRAM + (objTile * 16) + (yPx * 2) + 1);
+        int row = y - (obj->y - 16);
+        if(obj->attr.yFlip) {
+            row = objH - 1 - row;
+        }
+        u8 tile = (objH == 16)? (obj->chr & 0xFE) : obj->chr;
+        const u8* tileRow = ppu->vram + tile * 16 + row * 2;
+        u8 lo = tileRow[0];
+        u8 hi = tileRow[1];
+        if(obj->attr.xFlip) {
+            lo = gReverseBits[lo];
+            hi = gReverseBits[hi];
+        }
+
+        // Colour 0 is transparent and doesn't take the pixel
+        u8 opaque = (lo | hi) & ~ppu_line_mask_get(ppu->objLineMask, x);
+        if(opaque == 0) {
+            continue;
+        }
+        ppu_line_mask_set(ppu->objLineMask, x, opaque);
 
-        int xStart = objX - 8;
-        int xPxStart = 0;
-        if(xStart < 0) {
-            xStart = 0;
-            xPxStart = 8 - objX;
+        u8 visible = opaque;
+        if(obj->attr.priority) {
+            visible &= ~ppu_line_mask_get(ppu->bgLineMask, x);
         }
-        
-        // printf("\nCorr: ID: %#02x, X: %#02x, Y: %#02x, Attr: %#02x\n", 
-        //         gb_read8(ppu->gb, 0xFE00), gb_read8(ppu->gb, 0xFE01), gb_read8(ppu->gb, 0xFE02), gb_read8(ppu->gb, 0xFE03));
-        // printf("Mine: ID: %#02x, X: %#02x, Y: %#02x, Attr: %#02x\n", 
-        //         objY, objX, objTile, objAttr);
-        // printf("xStart: %d, xPxStart: %d, y: %d, yPx: %d\n", xStart, xPxStart, y, yPx);
-        for(int xPx = xPxStart; xPx < 8; xPx++) {
-            u8 pixelBitMask = (1 << (7 - xPx));
-        
-            u8 colorHigh = (lineByte2 & pixelBitMask) >> (7 - xPx);
-            u8 colorLow =  (lineByte1 & pixelBitMask) >> (7 - xPx);
-            u8 twoBitColor = colorLow | (colorHigh << 1);
-            u8 pal = (objAttr & 0x10)? *ppu->obp1 : *ppu->obp0;
-            u8 bgpColor = (pal >> (twoBitColor * 2)) & 0x3;
-
-            u32 finalColor = gColors[bgpColor];
-
-            ppu->framebuffer[(y * 160) + xStart + xPx] = finalColor;
+
+        const u8* colors = palettes[obj->attr.dmgPal];
+        for(int px = 0; px < 8; px++) {
+            u8 bit = 0x80 >> px;
+            if(visible & bit) {
+                int c = ((lo & bit)? 1 : 0) | ((hi & bit)? 2 : 0);
+                line[x + px] = colors[c];
+            }
         }
     }
-
-    ppu->objsThisScanline = 0;
 }
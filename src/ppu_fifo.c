@@ -0,0 +1,239 @@
+#include "ppu.h"
+#include "gb.h"
+#include "hostprof.h"
+
+#include <string.h>
+
+// Mode 3 a dot at a time, the way the DMG draws it. A fetcher reads the
+// BG or window a tile row at a time into one FIFO, objects are fetched
+// into a second one as their X comes up, and a pixel is shifted out of
+// both each dot the FIFOs aren't stalled. Registers are read as each
+// step happens, so writes between instructions show up mid-line, and
+// mode 3 grows with the fine scroll, the window and objects like it does
+// on hardware (172 dots at least).
+
+// Fetcher steps take 2 dots each, pushing waits until the BG FIFO is empty
+enum fetch_step_e {
+    FETCH_TILE,
+    FETCH_LOW,
+    FETCH_HIGH,
+    FETCH_PUSH
+};
+
+#define FIFO_NO_OBJ  0xFF
+#define FIFO_OBJ_DOTS 6
+
+void ppu_fifo_begin(struct ppu* ppu) {
+    struct ppu_fifo* f = &ppu->fifo;
+    memset(f, 0, sizeof(*f));
+    f->discard = *ppu->scx & 7;
+    f->warmup = 1;
+    f->objFetch = FIFO_NO_OBJ;
+}
+
+// One row of a BG or window tile, with the addressing LCDC picks
+static const u8* ppu_fifo_tile_row(struct ppu* ppu, u8 id, int fine) {
+    int tile = (ppu->lcdc->bgTilesArea)? id : 0x100 + (s8) id;
+    return ppu->vram + tile * 16 + fine * 2;
+}
+
+static int ppu_fifo_fine_y(struct ppu* ppu) {
+    struct ppu_fifo* f = &ppu->fifo;
+    if(f->inWindow) {
+        return ppu->winLine & 7;
+    }
+    return (u8) (*ppu->ly + *ppu->scy) & 7;
+}
+
+static void ppu_fifo_fetch(struct ppu* ppu) {
+    struct ppu_fifo* f = &ppu->fifo;
+
+    if(f->fetchStep != FETCH_PUSH) {
+        if(++f->fetchDot < 2) {
+            return;
+        }
+        f->fetchDot = 0;
+
+        switch(f->fetchStep) {
+            case FETCH_TILE:
+                if(f->inWindow) {
+                    u16 map = (ppu->lcdc->winMapArea)? 0x1C00 : 0x1800;
+                    f->tileId = ppu->vram[map + (ppu->winLine >> 3) * 32 + (f->fetchX & 31)];
+                } else {
+                    u16 map = (ppu->lcdc->bgMapArea)? 0x1C00 : 0x1800;
+                    u8 bgY = *ppu->ly + *ppu->scy;
+                    int column = ((*ppu->scx >> 3) + f->fetchX) & 31;
+                    f->tileId = ppu->vram[map + (bgY >> 3) * 32 + column];
+                }
+                break;
+            case FETCH_LOW:
+                f->tileLo = ppu_fifo_tile_row(ppu, f->tileId, ppu_fifo_fine_y(ppu))[0];
+                break;
+            case FETCH_HIGH:
+                f->tileHi = ppu_fifo_tile_row(ppu, f->tileId, ppu_fifo_fine_y(ppu))[1];
+                break;
+        }
+        f->fetchStep++;
+        if(f->fetchStep != FETCH_PUSH) {
+            return;
+        }
+    }
+
+    if(f->warmup) {
+        f->warmup = 0;
+        f->fetchStep = FETCH_TILE;
+        return;
+    }
+    if(f->bgCount > 0) {
+        return;
+    }
+    f->bgLo = f->tileLo;
+    f->bgHi = f->tileHi;
+    f->bgCount = 8;
+    f->fetchX++;
+    f->fetchStep = FETCH_TILE;
+}
+
+// The object that starts at the next pixel, lowest X first then lowest
+// OAM index. Objects hanging off the left edge all start at pixel 0
+static int ppu_fifo_next_obj(struct ppu* ppu) {
+    struct ppu_fifo* f = &ppu->fifo;
+    int found = FIFO_NO_OBJ;
+    int foundX = 0;
+    for(int i = 0; i < ppu->objsThisScanline; i++) {
+        if(f->objsDone & (1 << i)) {
+            continue;
+        }
+        int objX = ppu->objs[ppu->scanlineObjs[i]].x;
+        int start = (objX < 8)? 0 : objX - 8;
+        if(start == f->x && (found == FIFO_NO_OBJ || objX < foundX)) {
+            found = i;
+            foundX = objX;
+        }
+    }
+    return found;
+}
+
+// Mixes the object's row into the object FIFO, where it only takes the
+// pixels earlier objects left transparent
+static void ppu_fifo_merge_obj(struct ppu* ppu, int index) {
+    struct ppu_fifo* f = &ppu->fifo;
+    struct obj_t* obj = &ppu->objs[ppu->scanlineObjs[index]];
+    int objH = (ppu->lcdc->obj8x16)? 16 : 8;
+
+    int row = *ppu->ly - (obj->y - 16);
+    if(obj->attr.yFlip) {
+        row = objH - 1 - row;
+    }
+    u8 tile = (objH == 16)? (obj->chr & 0xFE) : obj->chr;
+    const u8* tileRow = ppu->vram + tile * 16 + row * 2;
+    u8 lo = tileRow[0];
+    u8 hi = tileRow[1];
+    if(obj->attr.xFlip) {
+        lo = gReverseBits[lo];
+        hi = gReverseBits[hi];
+    }
+    if(obj->x < 8) {
+        lo <<= 8 - obj->x;
+        hi <<= 8 - obj->x;
+    }
+
+    u8 take = (lo | hi) & ~(f->objLo | f->objHi);
+    f->objLo |= lo & take;
+    f->objHi |= hi & take;
+    f->objPal = (f->objPal & ~take) | ((obj->attr.dmgPal)? take : 0);
+    f->objPri = (f->objPri & ~take) | ((obj->attr.priority)? take : 0);
+}
+
+static void ppu_fifo_dot(struct ppu* ppu) {
+    struct ppu_fifo* f = &ppu->fifo;
+
+    // Object fetches wait for the fetcher to have a tile ready to push,
+    // then stall the FIFOs for 6 dots
+    if(f->objFetch != FIFO_NO_OBJ) {
+        if(f->fetchStep != FETCH_PUSH || f->bgCount == 0) {
+            ppu_fifo_fetch(ppu);
+        }
+        if(f->fetchStep == FETCH_PUSH && f->bgCount > 0 && ++f->objDots >= FIFO_OBJ_DOTS) {
+            ppu_fifo_merge_obj(ppu, f->objFetch);
+            f->objsDone |= 1 << f->objFetch;
+            f->objFetch = FIFO_NO_OBJ;
+        }
+        return;
+    }
+
+    if(f->bgCount > 0) {
+        if(f->discard > 0) {
+            f->bgLo <<= 1;
+            f->bgHi <<= 1;
+            f->bgCount--;
+            f->discard--;
+        } else if(!f->inWindow && ppu->lcdc->windowOn && ppu->winTriggered
+                  && *ppu->wx < 167 && f->x + 7 >= *ppu->wx) {
+            // The window restarts the fetcher on its own map
+            f->inWindow = 1;
+            f->bgCount = 0;
+            f->fetchStep = FETCH_TILE;
+            f->fetchDot = 0;
+            f->fetchX = 0;
+            if(f->x == 0 && *ppu->wx < 7) {
+                f->discard = 7 - *ppu->wx;
+            }
+        } else if(ppu->lcdc->objDispOn && (f->objFetch = ppu_fifo_next_obj(ppu)) != FIFO_NO_OBJ) {
+            f->objDots = 0;
+            return;
+        } else {
+            int bg = ((f->bgHi >> 6) & 2) | (f->bgLo >> 7);
+            int obj = ((f->objHi >> 6) & 2) | (f->objLo >> 7);
+            bool objPal = f->objPal & 0x80;
+            bool objPri = f->objPri & 0x80;
+            f->bgLo <<= 1;
+            f->bgHi <<= 1;
+            f->bgCount--;
+            f->objLo <<= 1;
+            f->objHi <<= 1;
+            f->objPal <<= 1;
+            f->objPri <<= 1;
+
+            // With the BG off it's blank, in the lightest shade
+            u8 shade = 0;
+            if(ppu->lcdc->bgDispOn) {
+                shade = (*ppu->bgp >> (bg * 2)) & 0x3;
+            } else {
+                bg = 0;
+            }
+            if(obj != 0 && ppu->lcdc->objDispOn && !(objPri && bg != 0)) {
+                u8 obp = (objPal)? *ppu->obp1 : *ppu->obp0;
+                shade = (obp >> (obj * 2)) & 0x3;
+            }
+            ppu->line[f->x++] = shade;
+        }
+    }
+
+    ppu_fifo_fetch(ppu);
+}
+
+int ppu_fifo_run(struct ppu* ppu) {
+    u64 start = (ppu->gb->perf.timePpu)? hostprof_now() : 0;
+
+    struct ppu_fifo* f = &ppu->fifo;
+    int length = 0;
+    while(f->dots < ppu->cyclesThisMode * 4) {
+        ppu_fifo_dot(ppu);
+        f->dots++;
+        if(f->x == 160) {
+            if(f->inWindow) {
+                ppu->winLine++;
+            }
+            ppu->objsThisScanline = 0;
+            ppu_commit_line(ppu);
+            length = (f->dots + 3) / 4;
+            break;
+        }
+    }
+
+    if(start != 0) {
+        ppu->gb->perf.ppuNs += hostprof_now() - start;
+    }
+    return length;
+}
@@ -0,0 +1,338 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "gb.h"
+
+#define FLAT_USED  0x80000000
+
+
+int profiler_init(struct profiler* p, u32 period) {
+    memset(p, 0, sizeof(struct profiler));
+    p->period = period? period : PROFILER_DEFAULT_PERIOD;
+
+    p->flatCap = 4096;
+    p->flatKeys = (u32*) calloc(p->flatCap, sizeof(u32));
+    p->flatCounts = (u32*) calloc(p->flatCap, sizeof(u32));
+    p->stackCap = 1024;
+    p->stacks = (struct profiler_stack*) calloc(p->stackCap, sizeof(struct profiler_stack));
+    p->framePoolCap = 16384;
+    p->framePool = (u32*) malloc(p->framePoolCap * sizeof(u32));
+
+    if(p->flatKeys == NULL || p->flatCounts == NULL || p->stacks == NULL || p->framePool == NULL) {
+        printf("Error allocating profiler tables!\n");
+        profiler_destroy(p);
+        return -1;
+    }
+    return 0;
+}
+
+void profiler_destroy(struct profiler* p) {
+    for(int i = 0; i < p->symbolCount; i++) {
+        free(p->symbols[i].name);
+    }
+    free(p->symbols);
+    free(p->flatKeys);
+    free(p->flatCounts);
+    free(p->stacks);
+    free(p->framePool);
+    memset(p, 0, sizeof(struct profiler));
+}
+
+static int profiler_symbol_compare(const void* a, const void* b) {
+    u32 aa = ((const struct profiler_symbol*) a)->addr;
+    u32 ba = ((const struct profiler_symbol*) b)->addr;
+    return (aa > ba) - (aa < ba);
+}
+
+// Reads an RGBDS .sym file: "BB:AAAA Label" per line, ';' comments
+int profiler_load_symbols(struct profiler* p, const char* path) {
+    FILE* f;
+    if((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+
+    int cap = 256;
+    p->symbols = (struct profiler_symbol*) malloc(cap * sizeof(struct profiler_symbol));
+
+    char line[512];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        unsigned int bank, addr;
+        char name[256];
+        if(line[0] == ';' || sscanf(line, "%x:%x %255s", &bank, &addr, name) != 3) {
+            continue;
+        }
+        if(p->symbolCount == cap) {
+            cap *= 2;
+            p->symbols = (struct profiler_symbol*) realloc(p->symbols, cap * sizeof(struct profiler_symbol));
+        }
+        p->symbols[p->symbolCount].addr = PROFILER_ADDR(bank, addr & 0xFFFF);
+        p->symbols[p->symbolCount].name = strdup(name);
+        p->symbolCount++;
+    }
+    fclose(f);
+
+    qsort(p->symbols, p->symbolCount, sizeof(struct profiler_symbol), profiler_symbol_compare);
+    printf("Loaded %d symbols from %s\n", p->symbolCount, path);
+    return 0;
+}
+
+// Finds the closest symbol at or before addr in the same bank
+const struct profiler_symbol* profiler_lookup(struct profiler* p, u32 addr) {
+    int lo = 0, hi = p->symbolCount - 1, found = -1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(p->symbols[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if(found < 0) {
+        return NULL;
+    }
+
+    const struct profiler_symbol* s = &p->symbols[found];
+    // Don't let the last ROM label swallow RAM addresses
+    if((s->addr >> 16) != (addr >> 16) || ((s->addr & 0xFFFF) < 0x8000) != ((addr & 0xFFFF) < 0x8000)) {
+        return NULL;
+    }
+    return s;
+}
+
+static u32 profiler_current_addr(struct cpu* cpu) {
+    u16 pc = cpu->pc;
+    u16 bank = (pc >= 0x4000 && pc < 0x8000)? cpu->gb->cart.romBank : 0;
+    return PROFILER_ADDR(bank, pc);
+}
+
+static void profiler_flat_add(struct profiler* p, u32 key) {
+    if(p->flatUsed * 2 >= p->flatCap) {
+        // Grow and rehash
+        u32 oldCap = p->flatCap;
+        u32* oldKeys = p->flatKeys;
+        u32* oldCounts = p->flatCounts;
+        p->flatCap *= 2;
+        p->flatKeys = (u32*) calloc(p->flatCap, sizeof(u32));
+        p->flatCounts = (u32*) calloc(p->flatCap, sizeof(u32));
+        for(u32 i = 0; i < oldCap; i++) {
+            if(oldKeys[i] & FLAT_USED) {
+                u32 j = (oldKeys[i] * 2654435761u) & (p->flatCap - 1);
+                while(p->flatKeys[j] & FLAT_USED)
+                    j = (j + 1) & (p->flatCap - 1);
+                p->flatKeys[j] = oldKeys[i];
+                p->flatCounts[j] = oldCounts[i];
+            }
+        }
+        free(oldKeys);
+        free(oldCounts);
+    }
+
+    key |= FLAT_USED;
+    u32 i = (key * 2654435761u) & (p->flatCap - 1);
+    while((p->flatKeys[i] & FLAT_USED) && p->flatKeys[i] != key)
+        i = (i + 1) & (p->flatCap - 1);
+    if(p->flatKeys[i] != key) {
+        p->flatKeys[i] = key;
+        p->flatUsed++;
+    }
+    p->flatCounts[i]++;
+}
+
+static void profiler_stack_add(struct profiler* p, u32 leaf) {
+    // Frames are the call targets, plus the function we're in now
+    u32 frames[PROFILER_MAX_DEPTH + 1];
+    u32 depth = 0;
+    for(int i = 0; i < p->depth; i++)
+        frames[depth++] = p->stack[i].addr;
+    frames[depth++] = leaf;
+
+    u64 hash = 1469598103934665603ULL;
+    for(u32 i = 0; i < depth; i++) {
+        hash ^= frames[i];
+        hash *= 1099511628211ULL;
+    }
+
+    if(p->stackUsed * 2 >= p->stackCap) {
+        u32 oldCap = p->stackCap;
+        struct profiler_stack* old = p->stacks;
+        p->stackCap *= 2;
+        p->stacks = (struct profiler_stack*) calloc(p->stackCap, sizeof(struct profiler_stack));
+        for(u32 i = 0; i < oldCap; i++) {
+            if(old[i].count > 0) {
+                u32 j = old[i].hash & (p->stackCap - 1);
+                while(p->stacks[j].count > 0)
+                    j = (j + 1) & (p->stackCap - 1);
+                p->stacks[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    u32 i = hash & (p->stackCap - 1);
+    while(p->stacks[i].count > 0) {
+        struct profiler_stack* s = &p->stacks[i];
+        if(s->hash == hash && s->depth == depth &&
+           memcmp(&p->framePool[s->frames], frames, depth * sizeof(u32)) == 0) {
+            s->count++;
+            return;
+        }
+        i = (i + 1) & (p->stackCap - 1);
+    }
+
+    if(p->framePoolLen + depth > p->framePoolCap) {
+        p->framePoolCap *= 2;
+        p->framePool = (u32*) realloc(p->framePool, p->framePoolCap * sizeof(u32));
+    }
+    memcpy(&p->framePool[p->framePoolLen], frames, depth * sizeof(u32));
+
+    p->stacks[i].hash = hash;
+    p->stacks[i].count = 1;
+    p->stacks[i].depth = depth;
+    p->stacks[i].frames = p->framePoolLen;
+    p->framePoolLen += depth;
+    p->stackUsed++;
+}
+
+static void profiler_push(struct profiler* p, u32 target, u16 sp) {
+    if(p->depth == PROFILER_MAX_DEPTH) {
+        // Drop the outermost frame to keep the innermost ones
+        memmove(&p->stack[0], &p->stack[1], (PROFILER_MAX_DEPTH - 1) * sizeof(struct profiler_frame));
+        p->depth--;
+    }
+    p->stack[p->depth].addr = target;
+    p->stack[p->depth].sp = sp;
+    p->depth++;
+}
+
+// Called by the profiling cpu core after every instruction,
+// before interrupts are serviced
+void profiler_step(struct profiler* p, struct cpu* cpu, u8 opcode, u16 oldSp) {
+    bool isCall = (opcode == 0xCD || opcode == 0xC4 || opcode == 0xCC || opcode == 0xD4 || opcode == 0xDC ||
+                   (opcode & 0xC7) == 0xC7); // RST
+    bool isRet = (opcode == 0xC9 || opcode == 0xD9 || opcode == 0xC0 || opcode == 0xC8 || opcode == 0xD0 || opcode == 0xD8);
+
+    // Only count calls/returns that were actually taken
+    if(isCall && cpu->sp == (u16)(oldSp - 2)) {
+        profiler_push(p, profiler_current_addr(cpu), cpu->sp);
+    }
+    else if(isRet && cpu->sp == (u16)(oldSp + 2)) {
+        // Also unwinds frames abandoned by code that reset SP
+        while(p->depth > 0 && p->stack[p->depth - 1].sp <= oldSp)
+            p->depth--;
+    }
+
+    if(cpu->cycles >= p->nextSample) {
+        p->nextSample = cpu->cycles + p->period;
+        p->samples++;
+
+        u32 addr = profiler_current_addr(cpu);
+        profiler_flat_add(p, addr);
+
+        // Fold leaf samples in the same function together
+        const struct profiler_symbol* sym = profiler_lookup(p, addr);
+        profiler_stack_add(p, sym? sym->addr : addr);
+    }
+}
+
+// Called after an interrupt was dispatched, pc is the vector
+void profiler_interrupt(struct profiler* p, struct cpu* cpu) {
+    profiler_push(p, profiler_current_addr(cpu), cpu->sp);
+}
+
+static const char* profiler_name(struct profiler* p, u32 addr, char* buf) {
+    const struct profiler_symbol* sym = profiler_lookup(p, addr);
+    if(sym != NULL) {
+        return sym->name;
+    }
+    sprintf(buf, "%02X:%04X", addr >> 16, addr & 0xFFFF);
+    return buf;
+}
+
+struct flat_row {
+    u32 addr;
+    u32 count;
+};
+
+static int flat_row_compare(const void* a, const void* b) {
+    u32 ca = ((const struct flat_row*) a)->count;
+    u32 cb = ((const struct flat_row*) b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+// One line per symbol (or per address, without symbols), hottest first
+int profiler_write_flat(struct profiler* p, const char* path) {
+    FILE* f;
+    if((f = fopen(path, "w")) == NULL) {
+        printf("Error opening profile file %s!\n", path);
+        return -1;
+    }
+
+    struct flat_row* rows = (struct flat_row*) malloc((p->flatUsed + 1) * sizeof(struct flat_row));
+    u32* symCounts = (u32*) calloc(p->symbolCount + 1, sizeof(u32));
+    int nRows = 0;
+
+    for(u32 i = 0; i < p->flatCap; i++) {
+        if(!(p->flatKeys[i] & FLAT_USED))
+            continue;
+        u32 addr = p->flatKeys[i] & ~FLAT_USED;
+        const struct profiler_symbol* sym = profiler_lookup(p, addr);
+        if(sym != NULL) {
+            symCounts[sym - p->symbols] += p->flatCounts[i];
+        } else {
+            rows[nRows].addr = addr;
+            rows[nRows].count = p->flatCounts[i];
+            nRows++;
+        }
+    }
+    for(int i = 0; i < p->symbolCount; i++) {
+        if(symCounts[i] > 0) {
+            rows = (struct flat_row*) realloc(rows, (nRows + 1) * sizeof(struct flat_row));
+            rows[nRows].addr = p->symbols[i].addr;
+            rows[nRows].count = symCounts[i];
+            nRows++;
+        }
+    }
+    qsort(rows, nRows, sizeof(struct flat_row), flat_row_compare);
+
+    fprintf(f, "# %llu samples, one every %u cycles\n", (unsigned long long) p->samples, p->period);
+    fprintf(f, "#  samples       %%  bank:addr  symbol\n");
+    for(int i = 0; i < nRows; i++) {
+        char buf[16];
+        double percent = p->samples? 100.0 * rows[i].count / p->samples : 0.0;
+        fprintf(f, "%10u  %6.2f  %02X:%04X    %s\n", rows[i].count, percent,
+                rows[i].addr >> 16, rows[i].addr & 0xFFFF, profiler_name(p, rows[i].addr, buf));
+    }
+
+    free(symCounts);
+    free(rows);
+    fclose(f);
+    return 0;
+}
+
+// Brendan Gregg's folded stack format: "outer;inner;leaf count"
+int profiler_write_folded(struct profiler* p, const char* path) {
+    FILE* f;
+    if((f = fopen(path, "w")) == NULL) {
+        printf("Error opening profile file %s!\n", path);
+        return -1;
+    }
+
+    for(u32 i = 0; i < p->stackCap; i++) {
+        const struct profiler_stack* s = &p->stacks[i];
+        if(s->count == 0)
+            continue;
+        for(u32 d = 0; d < s->depth; d++) {
+            char buf[16];
+            fprintf(f, "%s%s", (d > 0)? ";" : "", profiler_name(p, p->framePool[s->frames + d], buf));
+        }
+        fprintf(f, " %u\n", s->count);
+    }
+
+    fclose(f);
+    return 0;
+}
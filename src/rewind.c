@@ -0,0 +1,292 @@
+#include "rewind.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+#include "savestate.h"
+
+
+static size_t rewind_put_varint(u8* out, size_t v) {
+    size_t n = 0;
+    while(v >= 0x80) {
+        out[n++] = (u8)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (u8) v;
+    return n;
+}
+
+static size_t rewind_get_varint(const u8* in, size_t* pos) {
+    size_t v = 0;
+    int shift = 0;
+    u8 b;
+    do {
+        b = in[(*pos)++];
+        v |= (size_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while(b & 0x80);
+    return v;
+}
+
+// Run-length codes a ^ b as (zero run, literal run, literals) tokens.
+// Consecutive frames differ in few bytes, so this is mostly zero runs.
+// Memory pages that aren't dirty are known to be equal and skipped
+static size_t rewind_encode(const u8* a, const u8* b, size_t size, size_t memOffset, const u64* dirty, u8* out) {
+    size_t i = 0;
+    size_t o = 0;
+    while(i < size) {
+        size_t start = i;
+        for(;;) {
+            if(i >= memOffset && i < memOffset + STATE_MEM_SIZE) {
+                int page = (STATE_MEM_START + (i - memOffset)) >> GB_PAGE_SHIFT;
+                if(!((dirty[page >> 6] >> (page & 63)) & 1)) {
+                    i = memOffset + ((page + 1) << GB_PAGE_SHIFT) - STATE_MEM_START;
+                    continue;
+                }
+            }
+            if(i + 8 > size)
+                break;
+            u64 x, y;
+            memcpy(&x, a + i, 8);
+            memcpy(&y, b + i, 8);
+            if(x != y)
+                break;
+            i += 8;
+        }
+        while(i < size && a[i] == b[i])
+            i++;
+        size_t zeros = i - start;
+
+        // Literals end at the next run of 4 equal bytes
+        start = i;
+        while(i < size) {
+            if(a[i] == b[i] && i + 4 <= size && memcmp(a + i, b + i, 4) == 0)
+                break;
+            i++;
+        }
+        o += rewind_put_varint(out + o, zeros);
+        o += rewind_put_varint(out + o, i - start);
+        for(size_t j = start; j < i; j++)
+            out[o++] = a[j] ^ b[j];
+    }
+    return o;
+}
+
+// XORs an encoded delta into state, turning one side of it into the other
+static void rewind_apply(u8* state, const u8* in, size_t size) {
+    size_t i = 0;
+    size_t p = 0;
+    while(p < size) {
+        i += rewind_get_varint(in, &p);
+        size_t literals = rewind_get_varint(in, &p);
+        for(size_t j = 0; j < literals; j++)
+            state[i++] ^= in[p++];
+    }
+}
+
+// Called with the lock held
+static void rewind_drop_oldest(struct rewind* rw) {
+    struct rewind_entry* e = &rw->entries[rw->first];
+    rw->bytes -= e->size;
+    free(e->data);
+    e->data = NULL;
+    rw->first = (rw->first + 1) % rw->maxEntries;
+    rw->count--;
+}
+
+static void* rewind_worker(void* arg) {
+    struct rewind* rw = (struct rewind*) arg;
+
+    pthread_mutex_lock(&rw->lock);
+    for(;;) {
+        while(rw->running && rw->pendingCount == 0)
+            pthread_cond_wait(&rw->cond, &rw->lock);
+        if(!rw->running)
+            break;
+
+        u8* state = rw->pending[rw->pendingHead];
+        const u64* dirty = rw->pendingDirty[rw->pendingHead];
+        rw->busy = true;
+        pthread_mutex_unlock(&rw->lock);
+
+        // Nobody else touches latest or scratch while we're busy
+        u8* data = NULL;
+        size_t size = 0;
+        if(rw->haveLatest) {
+            size = rewind_encode(rw->latest, state, rw->stateSize, rw->memOffset, dirty, rw->scratch);
+            data = (u8*) malloc(size);
+            if(data != NULL)
+                memcpy(data, rw->scratch, size);
+        }
+        memcpy(rw->latest, state, rw->stateSize);
+
+        pthread_mutex_lock(&rw->lock);
+        if(rw->haveLatest) {
+            if(data == NULL) {
+                // Without the delta, older states can't be reached any more
+                while(rw->count > 0)
+                    rewind_drop_oldest(rw);
+            } else {
+                if(rw->count == rw->maxEntries)
+                    rewind_drop_oldest(rw);
+                struct rewind_entry* e = &rw->entries[(rw->first + rw->count) % rw->maxEntries];
+                e->data = data;
+                e->size = (u32) size;
+                rw->count++;
+                rw->bytes += size;
+                while(rw->bytes > rw->maxBytes && rw->count > 1)
+                    rewind_drop_oldest(rw);
+            }
+        }
+        rw->haveLatest = true;
+        rw->pendingHead = (rw->pendingHead + 1) % REWIND_PENDING;
+        rw->pendingCount--;
+        rw->busy = false;
+        pthread_cond_broadcast(&rw->cond);
+    }
+    pthread_mutex_unlock(&rw->lock);
+
+    return NULL;
+}
+
+int rewind_init(struct rewind* rw, int maxFrames, size_t maxBytes) {
+    memset(rw, 0, sizeof(struct rewind));
+    rw->maxEntries = (maxFrames > 0)? maxFrames : 1;
+    rw->maxBytes = maxBytes;
+    rw->entries = (struct rewind_entry*) calloc(rw->maxEntries, sizeof(struct rewind_entry));
+    if(rw->entries == NULL) {
+        printf("Error: Could not allocate the rewind buffer!\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&rw->lock, NULL);
+    pthread_cond_init(&rw->cond, NULL);
+    rw->running = true;
+    if(pthread_create(&rw->worker, NULL, rewind_worker, rw) != 0) {
+        printf("Error: Could not start the rewind worker!\n");
+        pthread_cond_destroy(&rw->cond);
+        pthread_mutex_destroy(&rw->lock);
+        free(rw->entries);
+        return -1;
+    }
+    return 0;
+}
+
+void rewind_destroy(struct rewind* rw) {
+    pthread_mutex_lock(&rw->lock);
+    rw->running = false;
+    pthread_cond_broadcast(&rw->cond);
+    pthread_mutex_unlock(&rw->lock);
+    pthread_join(rw->worker, NULL);
+
+    while(rw->count > 0)
+        rewind_drop_oldest(rw);
+    free(rw->entries);
+    free(rw->latest);
+    free(rw->scratch);
+    for(int i = 0; i < REWIND_PENDING; i++)
+        free(rw->pending[i]);
+    pthread_cond_destroy(&rw->cond);
+    pthread_mutex_destroy(&rw->lock);
+}
+
+static void rewind_free_buffers(struct rewind* rw) {
+    free(rw->latest);
+    free(rw->scratch);
+    for(int i = 0; i < REWIND_PENDING; i++) {
+        free(rw->pending[i]);
+        rw->pending[i] = NULL;
+    }
+    rw->latest = rw->scratch = NULL;
+    rw->stateSize = 0;
+}
+
+// Sizes the snapshot buffers for states of size bytes. States of another
+// size can't be diffed against the history, so it is dropped
+static int rewind_resize(struct rewind* rw, const struct gb* gb, size_t size) {
+    if(rw->stateSize != 0) {
+        rewind_clear(rw);
+        rewind_free_buffers(rw);
+    }
+
+    rw->latest = (u8*) malloc(size);
+    // Every token after the first covers at least 4 equal bytes,
+    // so a delta never outgrows the state by more than a few bytes
+    rw->scratch = (u8*) malloc(size + 32);
+    bool ok = (rw->latest != NULL && rw->scratch != NULL);
+    for(int i = 0; i < REWIND_PENDING; i++) {
+        rw->pending[i] = (u8*) malloc(size);
+        ok = ok && (rw->pending[i] != NULL);
+    }
+    if(!ok) {
+        printf("Error: Could not allocate rewind snapshots!\n");
+        rewind_free_buffers(rw);
+        return -1;
+    }
+    rw->stateSize = size;
+    rw->memOffset = gb_state_mem_offset(gb);
+    return 0;
+}
+
+// Queues a snapshot of gb. Never blocks on the worker, unless the state
+// size changed (e.g. another ROM was loaded)
+void rewind_push(struct rewind* rw, struct gb* gb) {
+    size_t size = gb_state_size(gb);
+    if(size != rw->stateSize && rewind_resize(rw, gb, size) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&rw->lock);
+    if(rw->pendingCount == REWIND_PENDING) {
+        rw->dropped++;
+        pthread_mutex_unlock(&rw->lock);
+        return;
+    }
+    int slot = (rw->pendingHead + rw->pendingCount) % REWIND_PENDING;
+    pthread_mutex_unlock(&rw->lock);
+
+    // The worker only reads queued slots, so this one is ours
+    gb_state_save(gb, rw->pending[slot]);
+    // Dropped frames keep their dirty pages for the next snapshot
+    memcpy(rw->pendingDirty[slot], gb->dirtyPages, sizeof(gb->dirtyPages));
+    gb_dirty_clear(gb);
+
+    pthread_mutex_lock(&rw->lock);
+    rw->pendingCount++;
+    pthread_cond_signal(&rw->cond);
+    pthread_mutex_unlock(&rw->lock);
+}
+
+// Restores the state before the newest one. Returns -1 once history runs out
+int rewind_step_back(struct rewind* rw, struct gb* gb) {
+    pthread_mutex_lock(&rw->lock);
+    while(rw->busy || rw->pendingCount > 0)
+        pthread_cond_wait(&rw->cond, &rw->lock);
+
+    if(rw->count == 0) {
+        pthread_mutex_unlock(&rw->lock);
+        return -1;
+    }
+    struct rewind_entry* e = &rw->entries[(rw->first + rw->count - 1) % rw->maxEntries];
+    rewind_apply(rw->latest, e->data, e->size);
+    rw->bytes -= e->size;
+    free(e->data);
+    e->data = NULL;
+    rw->count--;
+
+    int ret = gb_state_load(gb, rw->latest, rw->stateSize);
+    pthread_mutex_unlock(&rw->lock);
+    return ret;
+}
+
+void rewind_clear(struct rewind* rw) {
+    pthread_mutex_lock(&rw->lock);
+    while(rw->busy || rw->pendingCount > 0)
+        pthread_cond_wait(&rw->cond, &rw->lock);
+    while(rw->count > 0)
+        rewind_drop_oldest(rw);
+    rw->haveLatest = false;
+    pthread_mutex_unlock(&rw->lock);
+}
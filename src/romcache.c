@@ -0,0 +1,151 @@
+#include "romcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifndef __SWITCH__
+#include <sys/mman.h>
+#endif
+
+// The smallest cartridge fills 0x0000-0x7FFF, smaller files are padded
+#define ROM_MIN_SIZE 0x8000
+
+static pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static struct rom_image* gCache = NULL;
+
+
+// Loads a private, padded copy when the file can't be mapped directly
+static bool romcache_load_copy(struct rom_image* image, FILE* rom, size_t size) {
+    size_t allocSize = (size < ROM_MIN_SIZE)? ROM_MIN_SIZE : size;
+    image->data = (u8*) malloc(allocSize);
+    if(image->data == NULL) {
+        return false;
+    }
+    memset(image->data + size, 0xFF, allocSize - size);
+
+    rewind(rom);
+    if(fread(image->data, 1, size, rom) != size) {
+        free(image->data);
+        return false;
+    }
+    image->size = allocSize;
+    image->mapped = false;
+    return true;
+}
+
+static bool romcache_load(struct rom_image* image, FILE* rom, size_t size) {
+#ifndef __SWITCH__
+    if(size >= ROM_MIN_SIZE) {
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(rom), 0);
+        if(data != MAP_FAILED) {
+            image->data = (u8*) data;
+            image->size = size;
+            image->mapped = true;
+            return true;
+        }
+    }
+#endif
+    return romcache_load_copy(image, rom, size);
+}
+
+struct rom_image* romcache_acquire(FILE* rom) {
+    struct stat st;
+    if(fstat(fileno(rom), &st) < 0) {
+        printf("Error: Could not stat ROM file!\n");
+        return NULL;
+    }
+    if(st.st_size < 0x150) {
+        printf("Error: ROM is too small to contain a cartridge header!\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&gCacheLock);
+
+    for(struct rom_image* image = gCache; image != NULL; image = image->next) {
+        if(image->device == (u64) st.st_dev && image->inode == (u64) st.st_ino &&
+           image->mtime == (s64) st.st_mtime) {
+            image->refs++;
+            pthread_mutex_unlock(&gCacheLock);
+            return image;
+        }
+    }
+
+    struct rom_image* image = (struct rom_image*) malloc(sizeof(struct rom_image));
+    if(image == NULL || !romcache_load(image, rom, (size_t) st.st_size)) {
+        pthread_mutex_unlock(&gCacheLock);
+        free(image);
+        printf("Error: Could not load ROM!\n");
+        return NULL;
+    }
+    image->device = (u64) st.st_dev;
+    image->inode = (u64) st.st_ino;
+    image->mtime = (s64) st.st_mtime;
+    image->hashed = false;
+    image->refs = 1;
+    image->next = gCache;
+    gCache = image;
+
+    pthread_mutex_unlock(&gCacheLock);
+    return image;
+}
+
+void romcache_retain(struct rom_image* image) {
+    pthread_mutex_lock(&gCacheLock);
+    image->refs++;
+    pthread_mutex_unlock(&gCacheLock);
+}
+
+void romcache_release(struct rom_image* image) {
+    if(image == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&gCacheLock);
+    if(--image->refs > 0) {
+        pthread_mutex_unlock(&gCacheLock);
+        return;
+    }
+    for(struct rom_image** link = &gCache; *link != NULL; link = &(*link)->next) {
+        if(*link == image) {
+            *link = image->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gCacheLock);
+
+    if(image->mapped) {
+#ifndef __SWITCH__
+        munmap(image->data, image->size);
+#endif
+    } else {
+        free(image->data);
+    }
+    free(image);
+}
+
+// 64-bit hash of the ROM contents, computed once per image
+u64 romcache_hash(struct rom_image* image) {
+    pthread_mutex_lock(&gCacheLock);
+    if(!image->hashed) {
+        u64 h = 0x9E3779B97F4A7C15ULL ^ image->size;
+        size_t i = 0;
+        for(; i + 8 <= image->size; i += 8) {
+            u64 w;
+            memcpy(&w, image->data + i, 8);
+            h ^= w * 0xBF58476D1CE4E5B9ULL;
+            h = ((h << 31) | (h >> 33)) * 0x94D049BB133111EBULL;
+        }
+        for(; i < image->size; i++) {
+            h = (h ^ image->data[i]) * 0x100000001B3ULL;
+        }
+        h ^= h >> 29;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 32;
+        image->hash = h;
+        image->hashed = true;
+    }
+    u64 hash = image->hash;
+    pthread_mutex_unlock(&gCacheLock);
+    return hash;
+}
@@ -0,0 +1,383 @@
+#include "savestate.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gb.h"
+#include "cpu.h"
+#include "ppu.h"
+
+#define STATE_BYTE_ORDER 0x01020304
+
+struct state_header {
+    char magic[8];
+    u32 version;
+    u32 byteOrder;
+    u32 chunkCount;
+    u32 reserved;
+};
+
+struct state_chunk {
+    char tag[4];
+    u32 size; // Payload size, payloads are padded to 8 bytes
+};
+
+struct state_cpu {
+    u16 af, bc, de, hl;
+    u16 pc, sp;
+    u8 ime;
+    u8 stopped;
+    u8 pad[2];
+    s32 imeWait;
+    s32 lastCycles;
+    u64 cycles;
+};
+
+struct state_ppu {
+    s32 cyclesThisMode;
+    s32 vblankCycles;
+    u8 objsThisScanline;
+    u8 scanlineObjs[10];
+    u8 renderer;
+    u8 hblankCycles;
+    u8 winLine;
+    u8 winTriggered;
+    u8 pad[1];
+};
+
+struct state_gb {
+    u8 keysPressed;
+    u8 inBootrom;
+    u8 dmaScheduled;
+    u8 inDMA;
+    s32 dmaCycles;
+    u16 dmaAddress;
+    u8 pad[6];
+};
+
+struct state_mbc {
+    u16 romChecksum; // Global checksum from the header of the ROM in use
+    u16 romBank;
+    u8 mbcCode;
+    u8 regs[4];
+    u8 ramBank;
+    u8 ramEnabled;
+    u8 pad[5];
+};
+
+struct state_rtc {
+    s64 base;
+    u64 baseCycle;
+    u8 latched[5];
+    u8 select;
+    u8 halted;
+    u8 carry;
+};
+
+// Writes chunks at the cursor, or only measures them if buf is NULL
+struct state_writer {
+    u8* buf;
+    size_t pos;
+    u32 chunkCount;
+    size_t memPos; // Payload of the MEM chunk
+};
+
+static void state_put_chunk(struct state_writer* w, const char tag[4], const void* data, u32 size) {
+    if(w->buf != NULL) {
+        struct state_chunk chunk;
+        memcpy(chunk.tag, tag, 4);
+        chunk.size = size;
+        memcpy(w->buf + w->pos, &chunk, sizeof(chunk));
+        memcpy(w->buf + w->pos + sizeof(chunk), data, size);
+        memset(w->buf + w->pos + sizeof(chunk) + size, 0, ((size + 7) & ~7) - size);
+    }
+    w->pos += sizeof(struct state_chunk) + ((size + 7) & ~7);
+    w->chunkCount++;
+}
+
+static u16 state_rom_checksum(const struct gb* gb) {
+    if(gb->cart.rom == NULL) {
+        return 0;
+    }
+    return (gb->cart.rom[0x14E] << 8) | gb->cart.rom[0x14F];
+}
+
+static void state_write(const struct gb* gb, struct state_writer* w) {
+    const struct cpu* cpu = gb->cpu;
+    const struct ppu* ppu = gb->ppu;
+
+    struct state_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    header.version = STATE_VERSION;
+    header.byteOrder = STATE_BYTE_ORDER;
+    w->pos = sizeof(header);
+    w->chunkCount = 0;
+
+    struct state_cpu c;
+    memset(&c, 0, sizeof(c));
+    c.af = cpu->af; c.bc = cpu->bc; c.de = cpu->de; c.hl = cpu->hl;
+    c.pc = cpu->pc; c.sp = cpu->sp;
+    c.ime = cpu->ime;
+    c.stopped = cpu->stopped;
+    c.imeWait = cpu->imeWait;
+    c.lastCycles = cpu->lastCycles;
+    c.cycles = cpu->cycles;
+    state_put_chunk(w, "CPU ", &c, sizeof(c));
+
+    struct state_ppu p;
+    memset(&p, 0, sizeof(p));
+    p.cyclesThisMode = ppu->cyclesThisMode;
+    p.vblankCycles = ppu->vblankCycles;
+    p.objsThisScanline = ppu->objsThisScanline;
+    memcpy(p.scanlineObjs, ppu->scanlineObjs, sizeof(p.scanlineObjs));
+    p.renderer = ppu_get_renderer(ppu);
+    p.hblankCycles = ppu->hblankCycles;
+    p.winLine = ppu->winLine;
+    p.winTriggered = ppu->winTriggered;
+    state_put_chunk(w, "PPU ", &p, sizeof(p));
+    // Only the FIFO renderer keeps state within a line, but the chunk is
+    // always there so the state size doesn't follow the renderer
+    state_put_chunk(w, "FIFO", &ppu->fifo, sizeof(ppu->fifo));
+
+    struct state_gb g;
+    memset(&g, 0, sizeof(g));
+    g.keysPressed = gb->keysPressed;
+    g.inBootrom = gb->inBootrom;
+    g.dmaScheduled = gb->dmaScheduled;
+    g.inDMA = gb->inDMA;
+    g.dmaCycles = gb->dmaCycles;
+    g.dmaAddress = gb->dmaAddress;
+    state_put_chunk(w, "GB  ", &g, sizeof(g));
+
+    struct state_mbc m;
+    memset(&m, 0, sizeof(m));
+    m.romChecksum = state_rom_checksum(gb);
+    m.romBank = gb->cart.romBank;
+    m.mbcCode = gb->cart.mbcCode;
+    memcpy(m.regs, gb->cart.regs, sizeof(m.regs));
+    m.ramBank = gb->cart.ramBank;
+    m.ramEnabled = gb->cart.ramEnabled;
+    state_put_chunk(w, "MBC ", &m, sizeof(m));
+
+    if(gb->cart.ram != NULL) {
+        state_put_chunk(w, "CRAM", gb->cart.ram, gb->cart.ramBytes);
+    }
+
+    if(gb->cart.hasRtc) {
+        struct state_rtc r;
+        memset(&r, 0, sizeof(r));
+        r.base = gb->cart.rtc.base;
+        r.baseCycle = gb->cart.rtc.baseCycle;
+        memcpy(r.latched, gb->cart.rtc.latched, sizeof(r.latched));
+        r.select = gb->cart.rtc.select;
+        r.halted = gb->cart.rtc.halted;
+        r.carry = gb->cart.rtc.carry;
+        state_put_chunk(w, "RTC ", &r, sizeof(r));
+    }
+
+    w->memPos = w->pos + sizeof(struct state_chunk);
+    state_put_chunk(w, "MEM ", gb->mmap + STATE_MEM_START, STATE_MEM_SIZE);
+    state_put_chunk(w, "SHDE", ppu->shades, sizeof(ppu->shades));
+
+    if(w->buf != NULL) {
+        header.chunkCount = w->chunkCount;
+        memcpy(w->buf, &header, sizeof(header));
+    }
+}
+
+size_t gb_state_size(const struct gb* gb) {
+    struct state_writer w = { NULL, 0, 0, 0 };
+    state_write(gb, &w);
+    return w.pos;
+}
+
+// buf must hold at least gb_state_size() bytes. Returns the bytes written
+size_t gb_state_save(const struct gb* gb, u8* buf) {
+    struct state_writer w = { buf, 0, 0, 0 };
+    state_write(gb, &w);
+    return w.pos;
+}
+
+size_t gb_state_mem_offset(const struct gb* gb) {
+    struct state_writer w = { NULL, 0, 0, 0 };
+    state_write(gb, &w);
+    return w.memPos;
+}
+
+// Walks the chunks, returning the payload of the one tagged tag (or NULL
+// if there is none). With tag NULL, only checks every chunk is in bounds
+static bool state_walk_chunks(const u8* buf, size_t size, u32 chunkCount, const char* tag,
+                              const u8** payloadOut, u32* sizeOut) {
+    size_t pos = sizeof(struct state_header);
+    for(u32 i = 0; i < chunkCount; i++) {
+        if(size - pos < sizeof(struct state_chunk)) {
+            return false;
+        }
+        struct state_chunk chunk;
+        memcpy(&chunk, buf + pos, sizeof(chunk));
+        size_t payload = pos + sizeof(chunk);
+        size_t padded = ((size_t) chunk.size + 7) & ~(size_t) 7;
+        if(padded > size - payload) {
+            return false;
+        }
+        if(tag != NULL && memcmp(chunk.tag, tag, 4) == 0) {
+            *payloadOut = buf + payload;
+            *sizeOut = chunk.size;
+            return true;
+        }
+        pos = payload + padded;
+    }
+    if(tag != NULL) {
+        *payloadOut = NULL;
+    }
+    return true;
+}
+
+// Finds a chunk by tag, checking its payload is exactly expectedSize bytes
+static const u8* state_find_chunk(const u8* buf, size_t size, u32 chunkCount, const char* tag, u32 expectedSize) {
+    const u8* payload = NULL;
+    u32 payloadSize = 0;
+    state_walk_chunks(buf, size, chunkCount, tag, &payload, &payloadSize);
+    return (payload != NULL && payloadSize == expectedSize)? payload : NULL;
+}
+
+// Restores a state saved by gb_state_save for the same ROM. On failure
+// the instance is left untouched and -1 is returned
+int gb_state_load(struct gb* gb, const u8* buf, size_t size) {
+    struct state_header header;
+    if(size < sizeof(header)) {
+        printf("Error: Save state is truncated!\n");
+        return -1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if(memcmp(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+        printf("Error: Not a dijon save state!\n");
+        return -1;
+    }
+    if(header.byteOrder != STATE_BYTE_ORDER) {
+        printf("Error: Save state was made on a host with a different byte order!\n");
+        return -1;
+    }
+    if(header.version != STATE_VERSION) {
+        printf("Error: Save state version %u, expected %u!\n", header.version, STATE_VERSION);
+        return -1;
+    }
+
+    u32 n = header.chunkCount;
+    if(!state_walk_chunks(buf, size, n, NULL, NULL, NULL)) {
+        printf("Error: Save state is truncated!\n");
+        return -1;
+    }
+    const u8* cpuChunk = state_find_chunk(buf, size, n, "CPU ", sizeof(struct state_cpu));
+    const u8* ppuChunk = state_find_chunk(buf, size, n, "PPU ", sizeof(struct state_ppu));
+    const u8* gbChunk  = state_find_chunk(buf, size, n, "GB  ", sizeof(struct state_gb));
+    const u8* mbcChunk = state_find_chunk(buf, size, n, "MBC ", sizeof(struct state_mbc));
+    const u8* memChunk = state_find_chunk(buf, size, n, "MEM ", STATE_MEM_SIZE);
+    const u8* shdChunk = state_find_chunk(buf, size, n, "SHDE", sizeof(gb->ppu->shades));
+    const u8* ramChunk = state_find_chunk(buf, size, n, "CRAM", gb->cart.ramBytes);
+    const u8* rtcChunk = state_find_chunk(buf, size, n, "RTC ", sizeof(struct state_rtc));
+    const u8* fifoChunk = state_find_chunk(buf, size, n, "FIFO", sizeof(gb->ppu->fifo));
+    if(cpuChunk == NULL || ppuChunk == NULL || gbChunk == NULL || mbcChunk == NULL || memChunk == NULL ||
+       shdChunk == NULL) {
+        printf("Error: Save state is missing chunks or is corrupt!\n");
+        return -1;
+    }
+
+    struct state_mbc m;
+    memcpy(&m, mbcChunk, sizeof(m));
+    if(m.romChecksum != state_rom_checksum(gb) || m.mbcCode != gb->cart.mbcCode) {
+        printf("Error: Save state was made with a different ROM!\n");
+        return -1;
+    }
+    if(gb->cart.ram != NULL && ramChunk == NULL) {
+        printf("Error: Save state is missing cartridge RAM!\n");
+        return -1;
+    }
+    if(gb->cart.hasRtc && rtcChunk == NULL) {
+        printf("Error: Save state is missing the cartridge clock!\n");
+        return -1;
+    }
+
+    struct state_ppu p;
+    memcpy(&p, ppuChunk, sizeof(p));
+    if(p.renderer >= PPU_RENDERER_COUNT || fifoChunk == NULL) {
+        printf("Error: Save state is missing chunks or is corrupt!\n");
+        return -1;
+    }
+
+    struct state_gb g;
+    memcpy(&g, gbChunk, sizeof(g));
+    if(g.inBootrom && gb->bootrom == NULL) {
+        printf("Error: Save state was made in the bootrom, but none is loaded!\n");
+        return -1;
+    }
+
+    struct state_cpu c;
+    memcpy(&c, cpuChunk, sizeof(c));
+    struct cpu* cpu = gb->cpu;
+    cpu->af = c.af; cpu->bc = c.bc; cpu->de = c.de; cpu->hl = c.hl;
+    cpu->pc = c.pc; cpu->sp = c.sp;
+    cpu->ime = c.ime;
+    cpu->stopped = c.stopped;
+    cpu->imeWait = c.imeWait;
+    cpu->lastCycles = c.lastCycles;
+    cpu->cycles = c.cycles;
+
+    struct ppu* ppu = gb->ppu;
+    ppu->cyclesThisMode = p.cyclesThisMode;
+    ppu->vblankCycles = p.vblankCycles;
+    ppu->objsThisScanline = p.objsThisScanline;
+    memcpy(ppu->scanlineObjs, p.scanlineObjs, sizeof(ppu->scanlineObjs));
+    ppu->objIndexDirty = true;
+    ppu->hblankCycles = p.hblankCycles;
+    ppu->winLine = p.winLine;
+    ppu->winTriggered = p.winTriggered;
+    ppu->renderer = &gPPURenderers[p.renderer];
+    if(p.renderer == PPU_RENDERER_FIFO) {
+        memcpy(&ppu->fifo, fifoChunk, sizeof(ppu->fifo));
+    }
+
+    gb->keysPressed = g.keysPressed;
+    gb->inBootrom = g.inBootrom;
+    gb->dmaScheduled = g.dmaScheduled;
+    gb->inDMA = g.inDMA;
+    gb->dmaCycles = g.dmaCycles;
+    gb->dmaAddress = g.dmaAddress;
+
+    memcpy(gb->cart.regs, m.regs, sizeof(gb->cart.regs));
+    cart_map_rom_bank(&gb->cart, m.romBank);
+    cart_map_ram_bank(&gb->cart, m.ramBank);
+    gb->cart.ramEnabled = m.ramEnabled;
+    if(gb->cart.hasRtc) {
+        struct state_rtc r;
+        memcpy(&r, rtcChunk, sizeof(r));
+        gb->cart.rtc.base = r.base;
+        gb->cart.rtc.baseCycle = r.baseCycle;
+        memcpy(gb->cart.rtc.latched, r.latched, sizeof(r.latched));
+        gb->cart.rtc.select = r.select;
+        gb->cart.rtc.halted = r.halted;
+        gb->cart.rtc.carry = r.carry;
+    }
+    if(gb->cart.ram != NULL) {
+        memcpy(gb->cart.ram, ramChunk, gb->cart.ramBytes);
+        gb->cart.ramTouched = true;
+        if(gb->cart.battery) {
+            // The .sav follows the loaded state
+            gb->cart.ramDirtyStart = 0;
+            gb->cart.ramDirtyEnd = gb->cart.ramBytes;
+        }
+    }
+
+    memcpy(gb->mmap + STATE_MEM_START, memChunk, STATE_MEM_SIZE);
+    gb_dirty_mark_all(gb);
+    memcpy(ppu->shades, shdChunk, sizeof(ppu->shades));
+
+    // Pointers aren't saved, re-derive them for this instance
+    ppu_bind(ppu, gb);
+    ppu_repaint_output(ppu);
+    cpu->gb = gb;
+    cpu_update_core(cpu);
+
+    return 0;
+}
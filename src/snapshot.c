@@ -0,0 +1,158 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __SWITCH__
+#include <sys/mman.h>
+#endif
+
+#include "gb.h"
+#include "romcache.h"
+#include "savestate.h"
+
+
+// Checkpoint names end up in file names, so keep them tame
+static bool snapshot_valid_name(const char* name) {
+    if(name == NULL || name[0] == '\0' || name[0] == '.') {
+        return false;
+    }
+    for(const char* c = name; *c != '\0'; c++) {
+        bool ok = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                  (*c >= '0' && *c <= '9') || *c == '-' || *c == '_' || *c == '.';
+        if(!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int snapshot_path(char* out, size_t size, const char* dir, const struct gb* gb, const char* name) {
+    if(gb->cart.image == NULL) {
+        printf("Error: Snapshots need a ROM to be loaded!\n");
+        return -1;
+    }
+    if(!snapshot_valid_name(name)) {
+        printf("Error: Invalid snapshot name \"%s\", use letters, digits, '-', '_' and '.'\n", name? name : "");
+        return -1;
+    }
+    int n = snprintf(out, size, "%s/%016llx-%s%s", dir,
+                     (unsigned long long) romcache_hash(gb->cart.image), name, SNAPSHOT_EXTENSION);
+    if(n < 0 || (size_t) n >= size) {
+        printf("Error: Snapshot path is too long!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Saves gb's state as the checkpoint name. The file is written to a
+// temporary name and renamed, so readers never see a partial snapshot
+int snapshot_store(const char* dir, const struct gb* gb, const char* name) {
+    char path[1024];
+    if(snapshot_path(path, sizeof(path), dir, gb, name) < 0) {
+        return -1;
+    }
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        printf("Error: Could not create snapshot directory %s!\n", dir);
+        return -1;
+    }
+
+    size_t size = gb_state_size(gb);
+    u8* state = (u8*) malloc(size);
+    if(state == NULL) {
+        printf("Error: Not enough memory for a snapshot!\n");
+        return -1;
+    }
+    gb_state_save(gb, state);
+
+    char tmpPath[1100];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int) getpid());
+    FILE* f = fopen(tmpPath, "wb");
+    if(f == NULL) {
+        printf("Error: Could not write snapshot %s!\n", tmpPath);
+        free(state);
+        return -1;
+    }
+    bool ok = (fwrite(state, 1, size, f) == size);
+    ok = (fclose(f) == 0) && ok;
+    free(state);
+    if(!ok || rename(tmpPath, path) < 0) {
+        printf("Error: Could not write snapshot %s!\n", path);
+        remove(tmpPath);
+        return -1;
+    }
+
+    printf("Stored snapshot %s\n", path);
+    return 0;
+}
+
+// Maps the checkpoint name for gb's ROM. Returns -1 if there is none;
+// a snapshot can be restored any number of times until it is closed
+int snapshot_open(struct snapshot* s, const char* dir, const struct gb* gb, const char* name) {
+    s->data = NULL;
+    s->size = 0;
+    s->mapped = false;
+
+    char path[1024];
+    if(snapshot_path(path, sizeof(path), dir, gb, name) < 0) {
+        return -1;
+    }
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fileno(f), &st) < 0 || st.st_size <= 0) {
+        fclose(f);
+        return -1;
+    }
+    size_t size = (size_t) st.st_size;
+
+#ifndef __SWITCH__
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if(mapping != MAP_FAILED) {
+        fclose(f);
+        s->data = (const u8*) mapping;
+        s->size = size;
+        s->mapped = true;
+        return 0;
+    }
+#endif
+
+    u8* data = (u8*) malloc(size);
+    if(data == NULL || fread(data, 1, size, f) != size) {
+        printf("Error: Could not read snapshot %s!\n", path);
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    s->data = data;
+    s->size = size;
+    return 0;
+}
+
+int snapshot_restore(const struct snapshot* s, struct gb* gb) {
+    if(s->data == NULL) {
+        return -1;
+    }
+    return gb_state_load(gb, s->data, s->size);
+}
+
+void snapshot_close(struct snapshot* s) {
+    if(s->data == NULL) {
+        return;
+    }
+    if(s->mapped) {
+#ifndef __SWITCH__
+        munmap((void*) s->data, s->size);
+#endif
+    } else {
+        free((void*) s->data);
+    }
+    s->data = NULL;
+    s->size = 0;
+}
@@ -0,0 +1,105 @@
+#include "gb.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "ppu.h"
+
+// Everything below 0x8000 is ROM, which the MBC state already covers
+#define HASH_FIRST_PAGE 0x80
+
+#define HASH_K1 0x9E3779B97F4A7C15ULL
+#define HASH_K2 0xBF58476D1CE4E5B9ULL
+#define HASH_K3 0x94D049BB133111EBULL
+
+
+static inline u64 hash_mix(u64 h, u64 v) {
+    h ^= v * HASH_K1;
+    h = (h << 31) | (h >> 33);
+    return h * HASH_K2;
+}
+
+static inline u64 hash_final(u64 h) {
+    h ^= h >> 30;
+    h *= HASH_K2;
+    h ^= h >> 27;
+    h *= HASH_K3;
+    return h ^ (h >> 31);
+}
+
+static u64 hash_page(const u8* mem, int page) {
+    const u8* p = mem + (page << GB_PAGE_SHIFT);
+    // Seeded with the page number, so swapping two pages changes the hash
+    u64 h = hash_mix(HASH_K3, (u64) page);
+    for(int i = 0; i < (1 << GB_PAGE_SHIFT); i += 8) {
+        u64 w;
+        memcpy(&w, p + i, 8);
+        h = hash_mix(h, w);
+    }
+    return hash_final(h);
+}
+
+// Digest of the emulated machine: cpu registers, ppu and DMA timing,
+// mapper registers, cart RAM and memory from 0x8000 up. The host-side cycle
+// counter and the framebuffer are left out, so branches that reach the
+// same machine state by different routes hash the same.
+//
+// Only pages written since the previous call are rehashed; the page
+// hashes are XORed together so each one can be swapped out in place.
+// Writes are tracked in hashPending, which only this clears, see
+// gb_mark_dirty().
+u64 gb_state_hash(struct gb* gb) {
+    for(int page = HASH_FIRST_PAGE; page < GB_PAGE_COUNT; page++) {
+        if((gb->hashPending[page >> 6] >> (page & 63)) & 1) {
+            u64* slot = &gb->pageHashes[page - HASH_FIRST_PAGE];
+            u64 h = hash_page(gb->mmap, page);
+            gb->memHash ^= *slot ^ h;
+            *slot = h;
+        }
+    }
+    // The PPU updates LY and STAT through pointers, so the I/O page is
+    // always rehashed
+    memset(gb->hashPending, 0, sizeof(gb->hashPending));
+    gb->hashPending[3] = 1ULL << 63;
+
+    // Cart RAM is rarely written, so it is simply rehashed when it is
+    if(gb->cart.ramTouched) {
+        u64 h = HASH_K1;
+        for(u32 page = 0; page * 256 < gb->cart.ramBytes; page++) {
+            h = hash_mix(h, hash_page(gb->cart.ram, page));
+        }
+        gb->cartRamHash = hash_final(h);
+        gb->cart.ramTouched = false;
+    }
+
+    const struct cpu* cpu = gb->cpu;
+    const struct ppu* ppu = gb->ppu;
+    u64 h = gb->memHash ^ gb->cartRamHash;
+    h = hash_mix(h, (u64) cpu->af | (u64) cpu->bc << 16 | (u64) cpu->de << 32 | (u64) cpu->hl << 48);
+    h = hash_mix(h, (u64) cpu->pc | (u64) cpu->sp << 16 | (u64) cpu->ime << 32 | (u64)(u8) cpu->imeWait << 40 |
+                    (u64) cpu->stopped << 48);
+    h = hash_mix(h, (u64)(u32) ppu->cyclesThisMode | (u64)(u32) ppu->vblankCycles << 32);
+    u64 objs = ppu->objsThisScanline;
+    for(int i = 0; i < 10; i++)
+        objs = objs * 41 + ppu->scanlineObjs[i];
+    h = hash_mix(h, objs);
+    h = hash_mix(h, (u64)(u32) ppu->hblankCycles | (u64) ppu->winLine << 32 | (u64) ppu->winTriggered << 40 |
+                    (u64) ppu_get_renderer(ppu) << 48);
+    if(ppu_get_renderer(ppu) == PPU_RENDERER_FIFO) {
+        const u8* fifo = (const u8*) &ppu->fifo;
+        u64 f = 0;
+        for(size_t i = 0; i < sizeof(ppu->fifo); i++)
+            f = f * 41 + fifo[i];
+        h = hash_mix(h, f);
+    }
+    h = hash_mix(h, (u64) gb->keysPressed | (u64) gb->inBootrom << 8 | (u64) gb->dmaScheduled << 16 |
+                    (u64) gb->inDMA << 24 | (u64)(u32) gb->dmaCycles << 32);
+    h = hash_mix(h, (u64) gb->cart.ramBank | (u64) gb->cart.ramEnabled << 8 | (u64) gb->cart.rtc.select << 16 |
+                    (u64) gb->cart.rtc.halted << 24 | (u64) gb->cart.rtc.carry << 32);
+    u64 latched = 0;
+    memcpy(&latched, gb->cart.rtc.latched, sizeof(gb->cart.rtc.latched));
+    h = hash_mix(h, latched);
+    h = hash_mix(h, (u64) gb->dmaAddress | (u64) gb->cart.romBank << 16 | (u64) gb->cart.regs[0] << 32 |
+                    (u64) gb->cart.regs[1] << 40 | (u64) gb->cart.regs[2] << 48 | (u64) gb->cart.regs[3] << 56);
+    return hash_final(h);
+}
@@ -0,0 +1,150 @@
+#include "tilecache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+#include "ppu.h"
+
+
+int tilecache_init(struct tilecache* tc) {
+    memset(tc, 0, sizeof(struct tilecache));
+    tc->tiles = (u32*) malloc(TILECACHE_TILES_W * TILECACHE_TILES_H * sizeof(u32));
+    tc->maps[0] = (u32*) malloc(TILECACHE_MAP_W * TILECACHE_MAP_H * sizeof(u32));
+    tc->maps[1] = (u32*) malloc(TILECACHE_MAP_W * TILECACHE_MAP_H * sizeof(u32));
+    tc->objs = (u32*) malloc(TILECACHE_OBJS_W * TILECACHE_OBJS_H * sizeof(u32));
+
+    if(tc->tiles == NULL || tc->maps[0] == NULL || tc->maps[1] == NULL || tc->objs == NULL) {
+        printf("Error allocating tile cache pictures!\n");
+        tilecache_destroy(tc);
+        return -1;
+    }
+    return 0;
+}
+
+void tilecache_destroy(struct tilecache* tc) {
+    free(tc->tiles);
+    free(tc->maps[0]);
+    free(tc->maps[1]);
+    free(tc->objs);
+    tc->tiles = tc->maps[0] = tc->maps[1] = tc->objs = NULL;
+}
+
+static inline bool tilecache_tile_dirty(const struct tilecache* tc, int tile) {
+    return (tc->dirtyTiles[tile >> 6] >> (tile & 63)) & 1;
+}
+
+static void tilecache_decode_tile(struct tilecache* tc, const u8* data, int tile) {
+    u8* pixels = tc->tilePixels[tile];
+    for(int y = 0; y < 8; y++) {
+        u8 lo = data[y * 2];
+        u8 hi = data[y * 2 + 1];
+        for(int x = 0; x < 8; x++) {
+            int shift = 7 - x;
+            pixels[y * 8 + x] = ((lo >> shift) & 1) | (((hi >> shift) & 1) << 1);
+        }
+    }
+}
+
+static void tilecache_draw_tile(const struct tilecache* tc, int tile, const u32* colors, u32* dst, int pitch) {
+    const u8* pixels = tc->tilePixels[tile];
+    for(int y = 0; y < 8; y++) {
+        for(int x = 0; x < 8; x++) {
+            dst[y * pitch + x] = colors[pixels[y * 8 + x]];
+        }
+    }
+}
+
+// One 8x16 cell, transparent below an 8x8 object
+static void tilecache_draw_obj(const struct tilecache* tc, const struct obj_t* obj, int objH,
+                               const u32* colors, u32* dst) {
+    u8 tile = (objH == 16)? (obj->chr & 0xFE) : obj->chr;
+    for(int y = 0; y < 16; y++) {
+        u32* row = dst + y * TILECACHE_OBJS_W;
+        if(y >= objH) {
+            memset(row, 0, 8 * sizeof(u32));
+            continue;
+        }
+        int srcY = (obj->attr.yFlip)? objH - 1 - y : y;
+        const u8* pixels = tc->tilePixels[tile + (srcY >> 3)] + (srcY & 7) * 8;
+        for(int x = 0; x < 8; x++) {
+            row[x] = colors[pixels[(obj->attr.xFlip)? 7 - x : x]];
+        }
+    }
+}
+
+void tilecache_update(struct tilecache* tc, struct gb* gb) {
+    struct ppu* ppu = gb->ppu;
+    const u8* vram = ppu->vram;
+    const u8* oam = (const u8*) ppu->objs;
+    bool unsignedTiles = ppu->lcdc->bgTilesArea;
+    bool obj8x16 = ppu->lcdc->obj8x16;
+
+    // Palette and addressing changes touch every picture drawn with them
+    bool allTiles = !tc->primed || *ppu->bgp != tc->bgp;
+    bool allMaps = allTiles || unsignedTiles != tc->unsignedTiles;
+    bool allObjs = !tc->primed || *ppu->obp0 != tc->obp0 || *ppu->obp1 != tc->obp1 || obj8x16 != tc->obj8x16;
+
+    u32 bgColors[4];
+    u32 objColors[2][4];
+    for(int c = 0; c < 4; c++) {
+        bgColors[c] = gColors[(*ppu->bgp >> (c * 2)) & 0x3];
+        objColors[0][c] = gColors[(*ppu->obp0 >> (c * 2)) & 0x3];
+        objColors[1][c] = gColors[(*ppu->obp1 >> (c * 2)) & 0x3];
+    }
+    objColors[0][0] = objColors[1][0] = 0;
+
+    memset(tc->dirtyTiles, 0, sizeof(tc->dirtyTiles));
+    for(int t = 0; t < TILECACHE_TILES; t++) {
+        const u8* data = vram + t * 16;
+        bool changed = !tc->primed || memcmp(data, tc->vram + t * 16, 16) != 0;
+        if(changed) {
+            tilecache_decode_tile(tc, data, t);
+            tc->dirtyTiles[t >> 6] |= 1ULL << (t & 63);
+        }
+        if(changed || allTiles) {
+            u32* dst = tc->tiles + (t / 16) * 8 * TILECACHE_TILES_W + (t % 16) * 8;
+            tilecache_draw_tile(tc, t, bgColors, dst, TILECACHE_TILES_W);
+            tc->tilesChanged = true;
+        }
+    }
+
+    for(int m = 0; m < 2; m++) {
+        const u8* map = vram + 0x1800 + m * 0x400;
+        const u8* oldMap = tc->vram + 0x1800 + m * 0x400;
+        for(int e = 0; e < 0x400; e++) {
+            u8 id = map[e];
+            int tile = (unsignedTiles)? id : 0x100 + (s8) id;
+            if(!allMaps && id == oldMap[e] && !tilecache_tile_dirty(tc, tile)) {
+                continue;
+            }
+            u32* dst = tc->maps[m] + (e / 32) * 8 * TILECACHE_MAP_W + (e % 32) * 8;
+            tilecache_draw_tile(tc, tile, bgColors, dst, TILECACHE_MAP_W);
+            tc->mapsChanged[m] = true;
+        }
+    }
+
+    int objH = (obj8x16)? 16 : 8;
+    for(int o = 0; o < 40; o++) {
+        const struct obj_t* obj = &ppu->objs[o];
+        u8 tile = (obj8x16)? (obj->chr & 0xFE) : obj->chr;
+        bool dirty = allObjs || memcmp(oam + o * 4, tc->oam + o * 4, 4) != 0 || tilecache_tile_dirty(tc, tile) ||
+                     (obj8x16 && tilecache_tile_dirty(tc, tile + 1));
+        if(!dirty) {
+            continue;
+        }
+        u32* dst = tc->objs + (o / 8) * 16 * TILECACHE_OBJS_W + (o % 8) * 8;
+        tilecache_draw_obj(tc, obj, objH, objColors[obj->attr.dmgPal], dst);
+        tc->objsChanged = true;
+    }
+
+    memcpy(tc->vram, vram, sizeof(tc->vram));
+    memcpy(tc->oam, oam, sizeof(tc->oam));
+    tc->bgp = *ppu->bgp;
+    tc->obp0 = *ppu->obp0;
+    tc->obp1 = *ppu->obp1;
+    tc->unsignedTiles = unsignedTiles;
+    tc->obj8x16 = obj8x16;
+    tc->primed = true;
+}
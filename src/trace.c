@@ -0,0 +1,123 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "gb.h"
+
+
+static void* trace_writer(void* arg) {
+    struct tracer* t = (struct tracer*) arg;
+
+    for(;;) {
+        // Load running before head, so once we see it cleared
+        // the final head is visible too
+        bool running = atomic_load(&t->running);
+        u64 tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        u64 head = atomic_load_explicit(&t->head, memory_order_acquire);
+        if(head == tail) {
+            if(!running) {
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+
+        // Write out the contiguous run up to the end of the ring
+        u64 start = tail & (TRACE_RING_SIZE - 1);
+        u64 count = head - tail;
+        if(start + count > TRACE_RING_SIZE) {
+            count = TRACE_RING_SIZE - start;
+        }
+        fwrite(&t->ring[start], sizeof(struct trace_record), count, t->file);
+
+        atomic_store_explicit(&t->tail, tail + count, memory_order_release);
+    }
+
+    return NULL;
+}
+
+int trace_init(struct tracer* t, const char* path) {
+    if((t->file = fopen(path, "wb")) == NULL) {
+        printf("Error opening trace file %s!\n", path);
+        return -1;
+    }
+
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(struct trace_record);
+    fwrite(&header, sizeof(header), 1, t->file);
+
+    t->ring = (struct trace_record*) malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    if(t->ring == NULL) {
+        printf("Error allocating the trace ring!\n");
+        fclose(t->file);
+        return -1;
+    }
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->running, true);
+    t->cachedTail = 0;
+
+    if(pthread_create(&t->writer, NULL, trace_writer, t) != 0) {
+        printf("Error starting trace writer thread!\n");
+        free(t->ring);
+        fclose(t->file);
+        return -1;
+    }
+
+    return 0;
+}
+
+void trace_destroy(struct tracer* t) {
+    // The writer drains whatever is left before exiting
+    atomic_store(&t->running, false);
+    pthread_join(t->writer, NULL);
+
+    fclose(t->file);
+    free(t->ring);
+}
+
+void trace_push(struct tracer* t, struct cpu* cpu) {
+    u64 head = atomic_load_explicit(&t->head, memory_order_relaxed);
+
+    // Only re-read the shared tail when the ring looks full,
+    // and wait for the writer rather than dropping records
+    if(head - t->cachedTail >= TRACE_RING_SIZE) {
+        do {
+            t->cachedTail = atomic_load_explicit(&t->tail, memory_order_acquire);
+            if(head - t->cachedTail < TRACE_RING_SIZE) {
+                break;
+            }
+            sched_yield();
+        } while(true);
+    }
+
+    struct trace_record* r = &t->ring[head & (TRACE_RING_SIZE - 1)];
+    struct gb* gb = cpu->gb;
+    u16 pc = cpu->pc;
+
+    r->cycle = cpu->cycles;
+    r->pc = pc;
+    r->sp = cpu->sp;
+    r->bank = (pc >= 0x4000 && pc < 0x8000)? gb->cart.romBank : 0;
+    r->a = cpu->a;
+    r->f = cpu->f;
+    r->b = cpu->b;
+    r->c = cpu->c;
+    r->d = cpu->d;
+    r->e = cpu->e;
+    r->h = cpu->h;
+    r->l = cpu->l;
+    for(int i = 0; i < 4; i++) {
+        r->mem[i] = gb_read8(gb, pc + i);
+    }
+    memset(r->reserved, 0, sizeof(r->reserved));
+
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,23 @@
+#include <time.h>
+
+#include "bench.h"
+#include "cpu.h"
+
+
+double bench_now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_run_frame(struct gb* gb) {
+    u64 start = gb->cpu->cycles;
+    bool stopped = false;
+    bool frameCompleted = false;
+    while(!frameCompleted && !stopped && gb->cpu->cycles - start < FRAME_CYCLES) {
+        if(gb_run(gb, &stopped, &frameCompleted) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "gb.h"
+
+// Shared by the benchmark tools
+
+// One frame in m-cycles, used to stop frames while the LCD is off
+#define FRAME_CYCLES 17556
+
+double bench_now_seconds();
+
+// Runs until the next frame completes, or FRAME_CYCLES pass. Returns -1 if
+// the emulator failed.
+int bench_run_frame(struct gb* gb);
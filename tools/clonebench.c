@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+#include "bench.h"
+
+// Measures how fast instances can be branched with gb_clone.
+//
+// Usage: dijon-clonebench [-w frames] [-n clones] [-r frames] [bootrom] <rom>
+//   -w  Frames to run before cloning, so the state is realistic (default 120)
+//   -n  Number of clones to create (default 100000)
+//   -r  Also run each clone for this many frames before destroying it
+
+
+int main(int argc, char** argv) {
+    int warmupFrames = 120;
+    int clones = 100000;
+    int runFrames = 0;
+    const char* paths[2] = { NULL, NULL };
+    int numPaths = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            warmupFrames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            clones = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runFrames = atoi(argv[++i]);
+        } else if(numPaths < 2) {
+            paths[numPaths++] = argv[i];
+        }
+    }
+    if(numPaths < 1 || clones <= 0) {
+        printf("Usage: %s [-w frames] [-n clones] [-r frames] [bootrom] <rom>\n", argv[0]);
+        return 1;
+    }
+
+    struct gb gb;
+    gb_init(&gb);
+
+    if(numPaths == 2) {
+        FILE* bootrom = fopen(paths[0], "rb");
+        if(bootrom == NULL) {
+            printf("Error opening bootrom file!\n");
+            gb_destroy(&gb);
+            return 1;
+        }
+        gb_readBootrom(&gb, bootrom);
+        fclose(bootrom);
+    }
+
+    FILE* rom = fopen(paths[numPaths - 1], "rb");
+    if(rom == NULL || gb_readRom(&gb, rom) < 0) {
+        printf("Error opening rom file!\n");
+        if(rom != NULL)
+            fclose(rom);
+        gb_destroy(&gb);
+        return 1;
+    }
+    fclose(rom);
+    if(numPaths == 1) {
+        gb_skip_bootrom(&gb);
+    }
+
+    for(int i = 0; i < warmupFrames; i++) {
+        if(bench_run_frame(&gb) < 0) {
+            gb_destroy(&gb);
+            return 1;
+        }
+    }
+
+    struct gb_pool pool;
+    gb_pool_init(&pool, 64);
+
+    // Grow the pool once so the timed loops measure steady state
+    struct gb* warm = gb_clone(&pool, &gb);
+    if(warm == NULL) {
+        gb_pool_destroy(&pool);
+        gb_destroy(&gb);
+        return 1;
+    }
+    gb_destroy(warm);
+
+    double start = bench_now_seconds();
+    for(int i = 0; i < clones; i++) {
+        struct gb* clone = gb_clone(&pool, &gb);
+        if(clone == NULL) {
+            gb_pool_destroy(&pool);
+            gb_destroy(&gb);
+            return 1;
+        }
+        gb_destroy(clone);
+    }
+    double elapsed = bench_now_seconds() - start;
+    printf("clone+destroy: %d in %.3f s, %.0f clones/sec, %.2f us each\n",
+            clones, elapsed, clones / elapsed, elapsed / clones * 1e6);
+
+    if(runFrames > 0) {
+        start = bench_now_seconds();
+        for(int i = 0; i < clones; i++) {
+            struct gb* clone = gb_clone(&pool, &gb);
+            if(clone == NULL) {
+                gb_pool_destroy(&pool);
+                gb_destroy(&gb);
+                return 1;
+            }
+            for(int f = 0; f < runFrames; f++) {
+                bench_run_frame(clone);
+            }
+            gb_destroy(clone);
+        }
+        elapsed = bench_now_seconds() - start;
+        printf("clone+run %d frame(s)+destroy: %d in %.3f s, %.0f branches/sec\n",
+                runFrames, clones, elapsed, clones / elapsed);
+    }
+
+    gb_pool_destroy(&pool);
+    gb_destroy(&gb);
+
+    return 0;
+}
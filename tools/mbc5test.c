@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gb.h"
+
+// Checks MBC5 banking against a generated 8MB cartridge with 128KB of
+// RAM. Every ROM bank starts and ends with its own number, so mapping
+// each of the 512 banks at 0x4000 (bank 0 and the 9th bit through 0x3000
+// included) shows which one really got mapped. Each of the 16 RAM banks
+// is filled with a different pattern and read back.
+//
+// Usage: dijon-mbc5test [-o rom]
+//   -o  Also write the generated ROM here
+// Exits 1 on any mismatch.
+
+#define ROM_BANKS 512
+#define RAM_BANKS 16
+#define BANK_SIZE 0x4000
+
+// Stop listing mismatches after this many
+#define MAX_REPORTED 16
+
+static u8 gRom[ROM_BANKS * BANK_SIZE];
+static int gMismatches = 0;
+
+
+static void build_rom() {
+    memset(gRom, 0xFF, sizeof(gRom));
+    for(int bank = 0; bank < ROM_BANKS; bank++) {
+        u8* b = gRom + bank * BANK_SIZE;
+        b[0] = bank & 0xFF;
+        b[1] = bank >> 8;
+        b[BANK_SIZE - 2] = bank & 0xFF;
+        b[BANK_SIZE - 1] = bank >> 8;
+    }
+
+    memcpy(gRom + 0x134, "MBC5TEST", 8);
+    gRom[0x147] = 0x1A; // MBC5 + RAM
+    gRom[0x148] = 0x08; // 8MB
+    gRom[0x149] = 0x04; // 128KB
+    u8 checksum = 0;
+    for(int i = 0x134; i < 0x14D; i++) {
+        checksum = checksum - gRom[i] - 1;
+    }
+    gRom[0x14D] = checksum;
+}
+
+static void expect(const char* what, int index, u16 addr, u8 got, u8 expected) {
+    if(got == expected) {
+        return;
+    }
+    if(gMismatches < MAX_REPORTED) {
+        printf("%s %d: %04X reads %02X, expected %02X\n", what, index, addr, got, expected);
+    }
+    gMismatches++;
+}
+
+static void check_rom_banks(struct gb* gb) {
+    // Bank 1 is mapped after reset
+    expect("Reset bank", 1, 0x4000, gb_read8(gb, 0x4000), 1);
+
+    for(int bank = 0; bank < ROM_BANKS; bank++) {
+        gb_write8(gb, 0x3000, bank >> 8);
+        gb_write8(gb, 0x2000, bank & 0xFF);
+        expect("ROM bank", bank, 0x4000, gb_read8(gb, 0x4000), bank & 0xFF);
+        expect("ROM bank", bank, 0x4001, gb_read8(gb, 0x4001), bank >> 8);
+        expect("ROM bank", bank, 0x7FFE, gb_read8(gb, 0x7FFE), bank & 0xFF);
+        expect("ROM bank", bank, 0x7FFF, gb_read8(gb, 0x7FFF), bank >> 8);
+        // Bank 0 stays at 0x0000 whatever is selected
+        expect("ROM bank", bank, 0x0000, gb_read8(gb, 0x0000), 0);
+        expect("ROM bank", bank, 0x0001, gb_read8(gb, 0x0001), 0);
+    }
+}
+
+static u8 ram_pattern(int bank, int offset) {
+    return (u8) (bank * 37 + offset * 11 + 1);
+}
+
+static void check_ram_banks(struct gb* gb) {
+    static const u16 offsets[] = { 0x0000, 0x0001, 0x1000, 0x1FFE, 0x1FFF };
+    int count = sizeof(offsets) / sizeof(offsets[0]);
+
+    gb_write8(gb, 0x0000, 0x0A);
+    for(int bank = 0; bank < RAM_BANKS; bank++) {
+        gb_write8(gb, 0x4000, bank);
+        for(int i = 0; i < count; i++) {
+            gb_write8(gb, 0xA000 + offsets[i], ram_pattern(bank, i));
+        }
+    }
+    // Read back after every bank was written, so banks that alias show up
+    for(int bank = 0; bank < RAM_BANKS; bank++) {
+        gb_write8(gb, 0x4000, bank);
+        for(int i = 0; i < count; i++) {
+            u16 addr = 0xA000 + offsets[i];
+            expect("RAM bank", bank, addr, gb_read8(gb, addr), ram_pattern(bank, i));
+        }
+    }
+
+    // Disabled RAM reads open bus
+    gb_write8(gb, 0x0000, 0x00);
+    expect("Disabled RAM bank", RAM_BANKS - 1, 0xA000, gb_read8(gb, 0xA000), 0xFF);
+}
+
+int main(int argc, char** argv) {
+    const char* outPath = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outPath = argv[++i];
+        } else {
+            printf("Usage: %s [-o rom]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    build_rom();
+
+    FILE* rom = (outPath != NULL)? fopen(outPath, "w+b") : tmpfile();
+    if(rom == NULL || fwrite(gRom, 1, sizeof(gRom), rom) != sizeof(gRom) || fflush(rom) != 0) {
+        printf("Error writing the test ROM!\n");
+        if(rom != NULL)
+            fclose(rom);
+        return 1;
+    }
+
+    struct gb gb;
+    gb_init(&gb);
+    if(gb_readRom(&gb, rom) < 0) {
+        fclose(rom);
+        gb_destroy(&gb);
+        return 1;
+    }
+    fclose(rom);
+    gb_skip_bootrom(&gb);
+
+    if(gb.cart.romBanks != ROM_BANKS || gb.cart.ramBanks != RAM_BANKS) {
+        printf("Cartridge has %u ROM and %u RAM banks, expected %d and %d!\n",
+               gb.cart.romBanks, gb.cart.ramBanks, ROM_BANKS, RAM_BANKS);
+        gb_destroy(&gb);
+        return 1;
+    }
+
+    check_rom_banks(&gb);
+    check_ram_banks(&gb);
+    gb_destroy(&gb);
+
+    if(gMismatches > 0) {
+        printf("%d mismatches\n", gMismatches);
+        return 1;
+    }
+    printf("All %d ROM banks and %d RAM banks map correctly\n", ROM_BANKS, RAM_BANKS);
+    return 0;
+}
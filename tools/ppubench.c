@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+#include "ppu.h"
+#include "bench.h"
+
+// Compares the PPU renderers on the same ROMs: emulated frames per second,
+// host time in the PPU per frame, and how many frames came out different
+// from the scanline renderer's.
+//
+// Usage: dijon-ppubench [-w frames] [-n frames] [-b bootrom] <rom>...
+//   -w  Frames to run before timing, to get past title screens (default 120)
+//   -n  Frames to time (default 3000)
+//   -b  Boot through this bootrom instead of skipping it
+
+
+// FNV-1a over the shades of the last frame
+static u64 frame_hash(const struct ppu* ppu) {
+    const u8* shades = &ppu->shades[0][0];
+    u64 h = 0xCBF29CE484222325ULL;
+    for(size_t i = 0; i < sizeof(ppu->shades); i++) {
+        h = (h ^ shades[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static int load_gb(struct gb* gb, const char* bootromPath, const char* romPath) {
+    gb_init(gb);
+
+    if(bootromPath != NULL) {
+        FILE* bootrom = fopen(bootromPath, "rb");
+        if(bootrom == NULL) {
+            printf("Error opening bootrom file!\n");
+            gb_destroy(gb);
+            return -1;
+        }
+        gb_readBootrom(gb, bootrom);
+        fclose(bootrom);
+    }
+
+    FILE* rom = fopen(romPath, "rb");
+    if(rom == NULL || gb_readRom(gb, rom) < 0) {
+        printf("Error opening rom file %s!\n", romPath);
+        if(rom != NULL)
+            fclose(rom);
+        gb_destroy(gb);
+        return -1;
+    }
+    fclose(rom);
+    if(bootromPath == NULL) {
+        gb_skip_bootrom(gb);
+    }
+    return 0;
+}
+
+// Runs one ROM with one renderer. hashes holds the scanline renderer's
+// frames, which the others are compared against
+static int bench(const char* bootromPath, const char* romPath, enum ppu_renderer_e renderer,
+                 int warmupFrames, int frames, u64* hashes) {
+    struct gb gb;
+    if(load_gb(&gb, bootromPath, romPath) < 0) {
+        return -1;
+    }
+    ppu_set_renderer(gb.ppu, renderer);
+    gb.perf.timePpu = true;
+
+    for(int i = 0; i < warmupFrames; i++) {
+        if(bench_run_frame(&gb) < 0) {
+            gb_destroy(&gb);
+            return -1;
+        }
+    }
+
+    int differing = 0;
+    u64 ppuStart = gb.perf.ppuNs;
+    double start = bench_now_seconds();
+    for(int i = 0; i < frames; i++) {
+        if(bench_run_frame(&gb) < 0) {
+            gb_destroy(&gb);
+            return -1;
+        }
+        u64 h = frame_hash(gb.ppu);
+        if(renderer == PPU_RENDERER_SCANLINE) {
+            hashes[i] = h;
+        } else if(hashes[i] != h) {
+            differing++;
+        }
+    }
+    double elapsed = bench_now_seconds() - start;
+    double ppuMs = (gb.perf.ppuNs - ppuStart) / 1e6 / frames;
+
+    printf("  %-10s %8.0f frames/sec  %6.3f ms/frame in the PPU", gPPURenderers[renderer].name,
+            frames / elapsed, ppuMs);
+    if(renderer != PPU_RENDERER_SCANLINE) {
+        printf("  %d/%d frames differ", differing, frames);
+    }
+    printf("\n");
+
+    gb_destroy(&gb);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int warmupFrames = 120;
+    int frames = 3000;
+    const char* bootromPath = NULL;
+    int firstRom = argc;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            warmupFrames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            bootromPath = argv[++i];
+        } else {
+            firstRom = i;
+            break;
+        }
+    }
+    if(firstRom >= argc || frames <= 0) {
+        printf("Usage: %s [-w frames] [-n frames] [-b bootrom] <rom>...\n", argv[0]);
+        return 1;
+    }
+
+    u64* hashes = (u64*) malloc(frames * sizeof(u64));
+    if(hashes == NULL) {
+        return 1;
+    }
+
+    int failed = 0;
+    for(int i = firstRom; i < argc; i++) {
+        printf("%s\n", argv[i]);
+        for(int r = 0; r < PPU_RENDERER_COUNT; r++) {
+            if(bench(bootromPath, argv[i], (enum ppu_renderer_e) r, warmupFrames, frames, hashes) < 0) {
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    free(hashes);
+    return failed;
+}
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// Compares a binary trace written with `dijon -t` against a text log
+// from a reference emulator, and stops at the first divergence.
+//
+// Usage: dijon-tracediff [-c lines] [-s pc] <trace.bin|-> <reference.log|->
+//   -c  Lines of context to show around the divergence (default 8)
+//   -s  Skip trace records until execution first reaches pc (hex),
+//       e.g. -s 100 to line up with post-bootrom reference logs
+//
+// Regular files are memory-mapped, pipes (or `-` for stdin) are read
+// in large blocks, so a live `dijon -t` FIFO can be compared directly.
+//
+// Reference lines are parsed by register labels, so both the
+// gameboy-doctor format ("A:01 F:B0 ... SP:FFFE PC:0100 PCMEM:..")
+// and dijon's own -v register dump ("0100: ... A:01 B:00 ... SP:FFFE")
+// are understood. Only the registers present on a line are compared.
+
+#define BLOCK_SIZE    (8 << 20)
+#define MAX_CONTEXT   64
+
+#define REG_A     0x001
+#define REG_F     0x002
+#define REG_B     0x004
+#define REG_C     0x008
+#define REG_D     0x010
+#define REG_E     0x020
+#define REG_H     0x040
+#define REG_L     0x080
+#define REG_SP    0x100
+#define REG_PC    0x200
+#define REG_PCMEM 0x400
+
+struct regs {
+    u16 mask;
+    u8 a, f, b, c, d, e, h, l;
+    u16 sp, pc;
+    u8 mem[4];
+};
+
+// A file that is either memory-mapped whole, or streamed through
+// a block buffer
+struct source {
+    int fd;
+    u8* data;
+    size_t len;
+    size_t pos;
+    bool mapped;
+    bool eof;
+};
+
+static s8 hexval[256];
+
+
+static void init_hexval() {
+    memset(hexval, -1, sizeof(hexval));
+    for(int i = 0; i < 10; i++)
+        hexval['0' + i] = i;
+    for(int i = 0; i < 6; i++) {
+        hexval['A' + i] = 10 + i;
+        hexval['a' + i] = 10 + i;
+    }
+}
+
+static int source_open(struct source* s, const char* path) {
+    s->fd = (strcmp(path, "-") == 0)? STDIN_FILENO : open(path, O_RDONLY);
+    if(s->fd < 0) {
+        printf("Error opening %s!\n", path);
+        return -1;
+    }
+    s->pos = 0;
+    s->mapped = false;
+    s->eof = false;
+
+    struct stat st;
+    if(fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+        if(p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            s->data = (u8*) p;
+            s->len = st.st_size;
+            s->mapped = true;
+            s->eof = true;
+            return 0;
+        }
+    }
+
+    s->data = (u8*) malloc(BLOCK_SIZE);
+    s->len = 0;
+    return 0;
+}
+
+static void source_close(struct source* s) {
+    if(s->mapped)
+        munmap(s->data, s->len);
+    else
+        free(s->data);
+    if(s->fd != STDIN_FILENO)
+        close(s->fd);
+}
+
+// Makes at least `need` bytes available after pos, unless the input
+// ends first. Returns the number of bytes available
+static size_t source_fill(struct source* s, size_t need) {
+    if(s->len - s->pos >= need || s->eof) {
+        return s->len - s->pos;
+    }
+
+    // Slide the leftover partial block to the start and top it up
+    memmove(s->data, s->data + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+    while(s->len < need && !s->eof) {
+        ssize_t n = read(s->fd, s->data + s->len, BLOCK_SIZE - s->len);
+        if(n <= 0)
+            s->eof = true;
+        else
+            s->len += n;
+    }
+    return s->len;
+}
+
+static const struct trace_record* next_record(struct source* s) {
+    if(source_fill(s, sizeof(struct trace_record)) < sizeof(struct trace_record)) {
+        return NULL;
+    }
+    const struct trace_record* r = (const struct trace_record*) (s->data + s->pos);
+    s->pos += sizeof(struct trace_record);
+    return r;
+}
+
+// Returns the next line (without the newline) and its length
+static const char* next_line(struct source* s, size_t* len) {
+    for(;;) {
+        size_t avail = s->len - s->pos;
+        const char* p = (const char*) (s->data + s->pos);
+        const char* nl = (const char*) memchr(p, '\n', avail);
+        if(nl != NULL) {
+            *len = nl - p;
+            s->pos += *len + 1;
+            return p;
+        }
+        if(s->eof || avail == BLOCK_SIZE) {
+            // Last line without a newline, or one longer than a block
+            if(avail == 0)
+                return NULL;
+            *len = avail;
+            s->pos += avail;
+            return p;
+        }
+        source_fill(s, BLOCK_SIZE);
+    }
+}
+
+static bool parse_hex(const char* p, const char* end, int digits, u16* out) {
+    if(end - p < digits)
+        return false;
+    u16 v = 0;
+    for(int i = 0; i < digits; i++) {
+        s8 h = hexval[(u8) p[i]];
+        if(h < 0)
+            return false;
+        v = (v << 4) | h;
+    }
+    *out = v;
+    return true;
+}
+
+// Fast path for the fixed-layout gameboy-doctor format
+static bool parse_doctor_line(const char* p, size_t len, struct regs* r) {
+    static const char layout[] = "A:00 F:00 B:00 C:00 D:00 E:00 H:00 L:00 SP:0000 PC:0000 PCMEM:00,00,00,00";
+    if(len < sizeof(layout) - 1 || p[0] != 'A' || p[1] != ':' || p[40] != 'S' || p[48] != 'P' || p[56] != 'P')
+        return false;
+
+    const char* end = p + len;
+    u16 v[14];
+    static const int offs[14] = { 2, 7, 12, 17, 22, 27, 32, 37, 43, 51, 62, 65, 68, 71 };
+    static const int digits[14] = { 2, 2, 2, 2, 2, 2, 2, 2, 4, 4, 2, 2, 2, 2 };
+    for(int i = 0; i < 14; i++) {
+        if(!parse_hex(p + offs[i], end, digits[i], &v[i]))
+            return false;
+    }
+    r->a = v[0]; r->f = v[1]; r->b = v[2]; r->c = v[3];
+    r->d = v[4]; r->e = v[5]; r->h = v[6]; r->l = v[7];
+    r->sp = v[8]; r->pc = v[9];
+    for(int i = 0; i < 4; i++)
+        r->mem[i] = v[10 + i];
+    r->mask = REG_A | REG_F | REG_B | REG_C | REG_D | REG_E | REG_H | REG_L | REG_SP | REG_PC | REG_PCMEM;
+    return true;
+}
+
+static bool contains(const char* p, size_t len, const char* needle) {
+    size_t needleLen = strlen(needle);
+    for(size_t i = 0; i + needleLen <= len; i++) {
+        if(memcmp(p + i, needle, needleLen) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Skips ANSI colour sequences, as printed by log_instruction_line
+static const char* skip_escapes(const char* p, const char* end) {
+    while(p < end && *p == '\033') {
+        while(p < end && *p != 'm')
+            p++;
+        if(p < end)
+            p++;
+    }
+    return p;
+}
+
+// Generic path: scan for "<label>:<hex>" pairs anywhere on the line
+static void parse_labelled_line(const char* p, size_t len, struct regs* r) {
+    const char* end = p + len;
+    r->mask = 0;
+
+    // dijon's own log starts with "PC: " instead of a PC label
+    const char* q = skip_escapes(p, end);
+    u16 v;
+    if(parse_hex(q, end, 4, &v) && q + 4 < end && q[4] == ':') {
+        r->pc = v;
+        r->mask |= REG_PC;
+        q += 5;
+    }
+
+    for(; q < end; q++) {
+        if(*q != ':' || q == p)
+            continue;
+        // Find the label before the colon
+        const char* label = q;
+        while(label > p && label[-1] >= 'A' && label[-1] <= 'Z')
+            label--;
+        int labelLen = q - label;
+        const char* val = skip_escapes(q + 1, end);
+
+        if(labelLen == 1) {
+            if(!parse_hex(val, end, 2, &v))
+                continue;
+            switch(*label) {
+                case 'A': r->a = v; r->mask |= REG_A; break;
+                case 'F': r->f = v; r->mask |= REG_F; break;
+                case 'B': r->b = v; r->mask |= REG_B; break;
+                case 'C': r->c = v; r->mask |= REG_C; break;
+                case 'D': r->d = v; r->mask |= REG_D; break;
+                case 'E': r->e = v; r->mask |= REG_E; break;
+                case 'H': r->h = v; r->mask |= REG_H; break;
+                case 'L': r->l = v; r->mask |= REG_L; break;
+            }
+        }
+        else if(labelLen == 2 && parse_hex(val, end, 4, &v)) {
+            if(label[0] == 'S' && label[1] == 'P') {
+                r->sp = v;
+                r->mask |= REG_SP;
+            }
+            else if(label[0] == 'P' && label[1] == 'C') {
+                r->pc = v;
+                r->mask |= REG_PC;
+            }
+        }
+        else if(labelLen == 5 && memcmp(label, "PCMEM", 5) == 0) {
+            int i = 0;
+            while(i < 4 && parse_hex(val, end, 2, &v)) {
+                r->mem[i++] = v;
+                val += 3;
+            }
+            if(i == 4)
+                r->mask |= REG_PCMEM;
+        }
+    }
+}
+
+static void record_to_regs(const struct trace_record* rec, struct regs* r) {
+    r->a = rec->a; r->f = rec->f; r->b = rec->b; r->c = rec->c;
+    r->d = rec->d; r->e = rec->e; r->h = rec->h; r->l = rec->l;
+    r->sp = rec->sp;
+    r->pc = rec->pc;
+    memcpy(r->mem, rec->mem, 4);
+}
+
+// Returns the mask of fields that differ
+static u16 compare_regs(const struct regs* t, const struct regs* ref) {
+    u16 diff = 0;
+    if(t->a != ref->a) diff |= REG_A;
+    if(t->f != ref->f) diff |= REG_F;
+    if(t->b != ref->b) diff |= REG_B;
+    if(t->c != ref->c) diff |= REG_C;
+    if(t->d != ref->d) diff |= REG_D;
+    if(t->e != ref->e) diff |= REG_E;
+    if(t->h != ref->h) diff |= REG_H;
+    if(t->l != ref->l) diff |= REG_L;
+    if(t->sp != ref->sp) diff |= REG_SP;
+    if(t->pc != ref->pc) diff |= REG_PC;
+    if(memcmp(t->mem, ref->mem, 4) != 0) diff |= REG_PCMEM;
+    return diff & ref->mask;
+}
+
+static void print_trace_line(const char* prefix, const struct trace_record* r) {
+    printf("%s A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X  (bank %02X, cycle %llu)\n",
+            prefix, r->a, r->f, r->b, r->c, r->d, r->e, r->h, r->l, r->sp, r->pc,
+            r->mem[0], r->mem[1], r->mem[2], r->mem[3], r->bank, (unsigned long long) r->cycle);
+}
+
+static void print_ref_line(const char* prefix, const char* line, size_t len) {
+    printf("%s %.*s\n", prefix, (int) len, line);
+}
+
+int main(int argc, char** argv) {
+    int contextLines = 8;
+    int skipTo = -1;
+    const char* paths[2] = { NULL, NULL };
+    int nPaths = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            contextLines = atoi(argv[++i]);
+            if(contextLines < 0) contextLines = 0;
+            if(contextLines > MAX_CONTEXT) contextLines = MAX_CONTEXT;
+        }
+        else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            skipTo = (int) strtol(argv[++i], NULL, 16);
+        }
+        else if(nPaths < 2) {
+            paths[nPaths++] = argv[i];
+        }
+    }
+    if(nPaths != 2) {
+        printf("Usage: %s [-c lines] [-s pc] <trace.bin|-> <reference.log|->\n", argv[0]);
+        return 2;
+    }
+
+    init_hexval();
+
+    struct source trace, ref;
+    if(source_open(&trace, paths[0]) < 0) {
+        return 2;
+    }
+    if(source_open(&ref, paths[1]) < 0) {
+        source_close(&trace);
+        return 2;
+    }
+
+    static char outBuf[1 << 16];
+    setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+
+    const struct trace_header* header = NULL;
+    if(source_fill(&trace, sizeof(struct trace_header)) >= sizeof(struct trace_header)) {
+        header = (const struct trace_header*) (trace.data + trace.pos);
+    }
+    if(header == NULL || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+       header->recordSize != sizeof(struct trace_record)) {
+        printf("%s is not a dijon trace file!\n", paths[0]);
+        source_close(&trace);
+        source_close(&ref);
+        return 2;
+    }
+    if(header->version != TRACE_VERSION) {
+        printf("%s is trace version %u, expected %u!\n", paths[0], header->version, TRACE_VERSION);
+        source_close(&trace);
+        source_close(&ref);
+        return 2;
+    }
+    trace.pos += sizeof(struct trace_header);
+
+    // Context history. Records are copied because streamed blocks
+    // get recycled underneath us
+    struct trace_record histTrace[MAX_CONTEXT];
+    char histRef[MAX_CONTEXT][128];
+    u64 n = 0;
+    u64 refLine = 0;
+    int result = 0;
+
+    const struct trace_record* rec = next_record(&trace);
+    if(skipTo >= 0) {
+        while(rec != NULL && rec->pc != skipTo)
+            rec = next_record(&trace);
+    }
+
+    bool skipNextRef = false;
+    for(; rec != NULL; rec = next_record(&trace)) {
+        size_t len;
+        const char* line;
+        struct regs refRegs;
+
+        // Find the next reference line with something to compare
+        do {
+            line = next_line(&ref, &len);
+            refLine++;
+            if(line == NULL)
+                break;
+            if(skipNextRef) {
+                // dijon's own log prints CB-prefixed opcodes on a second line
+                skipNextRef = false;
+                refRegs.mask = 0;
+                continue;
+            }
+            if(!parse_doctor_line(line, len, &refRegs)) {
+                parse_labelled_line(line, len, &refRegs);
+                if(contains(line, len, "PREFIX CB"))
+                    skipNextRef = true;
+            }
+        } while(refRegs.mask == 0);
+
+        if(line == NULL) {
+            printf("Reference log ended after %llu instructions; trace continues at PC %04X\n",
+                    (unsigned long long) n, rec->pc);
+            break;
+        }
+
+        struct regs traceRegs;
+        record_to_regs(rec, &traceRegs);
+        u16 diff = compare_regs(&traceRegs, &refRegs);
+
+        if(diff != 0) {
+            printf("Divergence at instruction %llu (reference line %llu):", (unsigned long long) n, (unsigned long long) refLine);
+            static const char* names[11] = { "A", "F", "B", "C", "D", "E", "H", "L", "SP", "PC", "PCMEM" };
+            for(int i = 0; i < 11; i++) {
+                if(diff & (1 << i))
+                    printf(" %s", names[i]);
+            }
+            printf("\n\n");
+
+            u64 first = (n > (u64) contextLines)? n - contextLines : 0;
+            for(u64 i = first; i < n; i++) {
+                print_trace_line("  trace", &histTrace[i % MAX_CONTEXT]);
+                printf("    ref %s\n", histRef[i % MAX_CONTEXT]);
+            }
+            print_trace_line("> trace", rec);
+            print_ref_line(">   ref", line, len);
+
+            // Show what each side does next
+            if(contextLines > 0)
+                printf("\n");
+            for(int i = 0; i < contextLines; i++) {
+                const struct trace_record* next = next_record(&trace);
+                if(next == NULL)
+                    break;
+                print_trace_line("  trace", next);
+            }
+            for(int i = 0; i < contextLines; i++) {
+                const char* next = next_line(&ref, &len);
+                if(next == NULL)
+                    break;
+                print_ref_line("    ref", next, len);
+            }
+            result = 1;
+            break;
+        }
+
+        if(contextLines > 0) {
+            histTrace[n % MAX_CONTEXT] = *rec;
+            int copyLen = (len < sizeof(histRef[0]))? len : sizeof(histRef[0]) - 1;
+            memcpy(histRef[n % MAX_CONTEXT], line, copyLen);
+            histRef[n % MAX_CONTEXT][copyLen] = '\0';
+        }
+        n++;
+    }
+
+    if(result == 0) {
+        printf("No divergence in %llu instructions\n", (unsigned long long) n);
+    }
+
+    source_close(&trace);
+    source_close(&ref);
+    return result;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "instructions.h"
+
+// Renders binary traces written with `dijon -t` as text.
+//
+// Usage: dijon-tracedump [-d] <trace.bin>
+//   -d  Output in gameboy-doctor format instead of the disassembly view
+
+#define RECORDS_PER_READ 4096
+
+
+static void print_record(const struct trace_record* r) {
+    // CB-prefixed instructions live in the second half of the table
+    u16 opcode = r->mem[0];
+    int len = instructions[opcode].len;
+    if(opcode == 0xCB) {
+        opcode = 256 + r->mem[1];
+        len = 2;
+    }
+
+    char bytes[16];
+    char operand[8] = "";
+    if(len == 1) {
+        sprintf(bytes, "%02X      ", r->mem[0]);
+    }
+    else if(len == 2) {
+        sprintf(bytes, "%02X %02X   ", r->mem[0], r->mem[1]);
+        if(r->mem[0] != 0xCB)
+            sprintf(operand, "%02X", r->mem[1]);
+    }
+    else {
+        sprintf(bytes, "%02X %02X %02X", r->mem[0], r->mem[1], r->mem[2]);
+        sprintf(operand, "%02X%02X", r->mem[2], r->mem[1]);
+    }
+
+    char disasm[40];
+    snprintf(disasm, sizeof(disasm), "%s%s", instructions[opcode].disasm, operand);
+
+    printf("%12llu %02X:%04X: %s %-20s A:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X F:%02X SP:%04X\n",
+            (unsigned long long) r->cycle, r->bank, r->pc, bytes, disasm,
+            r->a, r->b, r->c, r->d, r->e, r->h, r->l, r->f, r->sp);
+}
+
+static void print_record_doctor(const struct trace_record* r) {
+    printf("A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X\n",
+            r->a, r->f, r->b, r->c, r->d, r->e, r->h, r->l, r->sp, r->pc,
+            r->mem[0], r->mem[1], r->mem[2], r->mem[3]);
+}
+
+int main(int argc, char** argv) {
+    bool doctor = false;
+    const char* path = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-d") == 0) {
+            doctor = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    if(path == NULL) {
+        printf("Usage: %s [-d] <trace.bin>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f;
+    if((f = fopen(path, "rb")) == NULL) {
+        printf("Error opening trace file!\n");
+        return 1;
+    }
+
+    struct trace_header header;
+    if(fread(&header, sizeof(header), 1, f) != 1 ||
+       memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+       header.recordSize != sizeof(struct trace_record)) {
+        printf("Not a dijon trace file!\n");
+        fclose(f);
+        return 1;
+    }
+    if(header.version != TRACE_VERSION) {
+        printf("Trace file is version %u, expected %u!\n", header.version, TRACE_VERSION);
+        fclose(f);
+        return 1;
+    }
+
+    static char outBuf[1 << 20];
+    setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+
+    struct trace_record* records = (struct trace_record*) malloc(RECORDS_PER_READ * sizeof(struct trace_record));
+    size_t n;
+    while((n = fread(records, sizeof(struct trace_record), RECORDS_PER_READ, f)) > 0) {
+        for(size_t i = 0; i < n; i++) {
+            if(doctor)
+                print_record_doctor(&records[i]);
+            else
+                print_record(&records[i]);
+        }
+    }
+
+    free(records);
+    fclose(f);
+    return 0;
+}